@@ -13,6 +13,8 @@
 **    SundownClassTask      task-list
 **    SundownPageDefault    /var/www/html/README.md
 **    SundownDirectoryIndex index.md
+**    SundownCacheEntries   1024
+**    SundownCacheEntrySize 65536
 **    <Location /sundown>
 **      # AddHandler sundown .md
 **      SetHandler sundown
@@ -29,11 +31,28 @@
 #include "http_protocol.h"
 #include "http_main.h"
 #include "http_log.h"
+#include "http_core.h"
+#include "mod_status.h"
 #include "util_script.h"
 #include "ap_config.h"
 #include "apr_fnmatch.h"
 #include "apr_strings.h"
+#include "apr_lib.h"
 #include "apr_hash.h"
+#include "apr_shm.h"
+#include "apr_global_mutex.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#include "apr_thread_pool.h"
+#include "apr_buckets.h"
+#include "apr_mmap.h"
+#include "apr_atomic.h"
+#include "apr_optional_hooks.h"
+
+#if !defined(OS2) && !defined(WIN32) && !defined(BEOS) && !defined(NETWARE)
+#include "unixd.h"
+#define SUNDOWN_SET_MUTEX_PERMS
+#endif
 
 /* apreq2 */
 #include "apreq2/apreq_module_apache2.h"
@@ -54,6 +73,10 @@
 #define _PERR(p, format, args...)                                            \
     ap_log_perror(APLOG_MARK, APLOG_CRIT, 0,                                 \
                   p, "[SUNDOWN] %s(%d): "format, __FILE__, __LINE__, ##args)
+/* refusals a client can cause at will */
+#define _RINFO(r, format, args...)                                          \
+    ap_log_rerror(APLOG_MARK, APLOG_INFO, 0,                                \
+                  r, "[SUNDOWN] %s(%d): "format, __FILE__, __LINE__, ##args)
 #define _RDEBUG(r, format, args...)                       \
     ap_log_rerror(APLOG_MARK, SUNDOWN_DEBUG_LOG_LEVEL, 0, \
                   r, "[SUNDOWN_DEBUG] %s(%d): "format,    \
@@ -74,16 +97,31 @@
 #include "sundown/markdown.h"
 #include "sundown/html.h"
 #include "sundown/buffer.h"
+#include "sundown/arena.h"
 
 #define SUNDOWN_READ_UNIT       1024
 #define SUNDOWN_OUTPUT_UNIT     64
 #define SUNDOWN_CURL_TIMEOUT    30
+#define SUNDOWN_FETCH_TIMEOUT   60
 #define SUNDOWN_TITLE_DEFAULT   "Markdown"
 #define SUNDOWN_CONTENT_TYPE    "text/html"
 #define SUNDOWN_TAG             "<body*>"
 #define SUNDOWN_STYLE_DEFAULT   "default"
 #define SUNDOWN_STYLE_EXT       ".html"
+#define SUNDOWN_STYLE_ENTRIES   64
 #define SUNDOWN_DIRECTORY_INDEX "index.md"
+#define SUNDOWN_CACHE_ENTRY_SIZE 65536
+#define SUNDOWN_PARSER_KEEP     (64 * 1024)
+#define SUNDOWN_ARENA_CHUNK     (64 * 1024)
+#define SUNDOWN_DOCUMENT_KEEP   (1024 * 1024)
+#define SUNDOWN_MAX_NESTING     16
+#define SUNDOWN_PARALLEL_SIZE   (1024 * 1024)
+#define SUNDOWN_BLOCKMAP_SIZE   (64 * 1024)
+#define SUNDOWN_REMOTE_TTL      60
+
+#define SUNDOWN_ALLOCATOR_ARENA  0
+#define SUNDOWN_ALLOCATOR_POOL   1
+#define SUNDOWN_ALLOCATOR_MALLOC 2
 
 typedef struct {
     char *style_path;
@@ -94,225 +132,2569 @@ typedef struct {
     char *class_ul;
     char *class_ol;
     char *class_task;
+    apr_size_t max_buffer_size;
+    apr_off_t flush_size;
+    int max_nesting;
+    apr_off_t max_input_size;
+    apr_off_t max_remote_size;
+    apr_off_t max_work;
+    int allocator;
 } sundown_config_rec;
 
+/* rendered output cache: fixed size slots in shared memory */
+typedef struct {
+    apr_uint32_t hash;
+    apr_size_t key_size;
+    apr_size_t data_size;
+} sundown_cache_slot;
+
+typedef struct {
+    apr_shm_t *shm;
+    apr_global_mutex_t *mutex;
+    char *base;
+    int entries;
+    apr_size_t entry_size;
+    apr_size_t slot_size;
+} sundown_cache_rec;
+
+static sundown_cache_rec sundown_cache;
+
+/* parsers kept per thread between requests */
+typedef struct {
+    struct sd_markdown *markdown;
+    struct sd_callbacks callbacks;
+    struct html_renderopt options;
+    unsigned int extensions;
+    unsigned int flags;
+    int nesting;
+    int busy;
+    struct sd_document *document;
+    char *document_key;
+    struct sd_arena *arena;
+} sundown_parser_rec;
+
+#define SUNDOWN_PARSER_HTML 0
+#define SUNDOWN_PARSER_MAX  1
+
+#if APR_HAS_THREADS
+static apr_threadkey_t *sundown_parser_key;
+#endif
+
+/* streamed body */
+typedef struct {
+    request_rec *r;
+    apr_bucket_brigade *bb;
+    struct buf *capture;
+    apr_size_t capture_max;
+} sundown_stream_rec;
+
+/* parallel rendering of large documents: one thread pool per process */
+typedef struct {
+    int threads;
+    apr_size_t min_size;
+#if APR_HAS_THREADS
+    apr_thread_pool_t *pool;
+#endif
+} sundown_parallel_rec;
+
+static sundown_parallel_rec sundown_parallel;
+
+#if APR_HAS_THREADS
+typedef struct {
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    int running;
+    int closed;
+    int entries;
+} sundown_join_rec;
+
+/* range of a document rendered by a pool thread */
+typedef struct {
+    const struct sd_document *document;
+    struct html_renderopt options;
+    unsigned int extensions;
+    int nesting;
+    apr_size_t max_buffer_size;
+    apr_off_t max_work;
+    size_t spent;
+    size_t begin;
+    size_t end;
+    size_t next;
+    int base;
+    int headers;
+    int err;
+    struct buf *ob;
+    struct sdhtml_toc *entries;
+    sundown_join_rec *join;
+} sundown_segment_rec;
+#endif
+
+/* counters shared by all children */
+typedef struct {
+    apr_uint32_t buffer_limit;
+    apr_uint32_t buffer_nomem;
+    apr_uint32_t input_limit;
+    apr_uint32_t work_limit;
+    apr_uint32_t remote_fetches;
+    apr_uint32_t remote_limit;
+} sundown_stats_rec;
+
+static apr_shm_t *sundown_stats_shm;
+static sundown_stats_rec *sundown_stats;
+
+#define SUNDOWN_STATS_INC(name)                         \
+    do {                                                \
+        if (sundown_stats) {                            \
+            apr_atomic_inc32(&sundown_stats->name);     \
+        }                                               \
+    } while (0)
+
+/* style templates: per process, keyed by file name */
+typedef struct {
+    apr_pool_t *pool;
+    char *filename;
+    apr_time_t mtime;
+    apr_off_t size;
+    apr_time_t used;
+    const char *header;
+    apr_size_t header_size;
+    const char *footer;
+    apr_size_t footer_size;
+    int refcount;
+    int stale;
+} sundown_style_rec;
+
+typedef struct {
+    apr_pool_t *pool;
+    apr_hash_t *table;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+} sundown_styles_rec;
+
+static sundown_styles_rec sundown_styles;
+
+/* rendered top-level blocks of a page, reused for the blocks an edit of
+ * the file left alone */
+typedef struct {
+    apr_uint64_t hash;          /* text of the block */
+    apr_size_t begin;
+    apr_size_t end;
+    apr_size_t reach;           /* end of the text read to render it */
+    apr_size_t html;            /* output, in the map body */
+    apr_size_t html_size;
+    apr_size_t entries;         /* first toc entry, in the map entries */
+    apr_size_t nentries;
+    int base;                   /* headers before the block */
+    int headers;
+    int first;                  /* no output before the block */
+} sundown_block_rec;
+
+typedef struct {
+    apr_pool_t *pool;
+    char *filename;
+    char *options;              /* render options of the page key */
+    apr_uint64_t refs;
+    apr_size_t length;
+    sundown_block_rec *blocks;
+    int nblocks;
+    char *html;
+    struct sdhtml_toc *entries;
+    apr_time_t used;
+    int refcount;
+    int stale;
+} sundown_blockmap_rec;
+
+/* block maps: per process, keyed by file name */
+typedef struct {
+    apr_pool_t *pool;
+    apr_hash_t *table;
+    int max;
+    apr_size_t min_size;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+} sundown_blockmaps_rec;
+
+static sundown_blockmaps_rec sundown_blockmaps;
+
+/* fetched url documents: per process, keyed by url */
+typedef struct {
+    apr_pool_t *pool;
+    char *url;
+    char *data;
+    apr_size_t size;
+    char *etag;
+    char *last_modified;
+    apr_time_t fetched;
+    apr_time_t used;
+    int refcount;
+    int stale;
+} sundown_remote_rec;
+
+/* url fetching: idle curl handles and the connections, dns and tls
+ * sessions they share, per process */
+typedef struct {
+    apr_pool_t *pool;
+    CURLSH *share;
+    apr_array_header_t *handles;
+    apr_hash_t *table;
+    int max;
+    apr_interval_time_t ttl;
+    int max_fetches;
+#if APR_HAS_THREADS
+    apr_hash_t *flights;
+    apr_thread_mutex_t *mutex;
+    apr_thread_mutex_t *locks[CURL_LOCK_DATA_LAST];
+#endif
+} sundown_remotes_rec;
+
+static sundown_remotes_rec sundown_remotes;
+
+#if APR_HAS_THREADS
+/* fetch of a url in progress, shared by the requests asking for it */
+typedef struct {
+    apr_pool_t *pool;
+    char *url;
+    const char *data;
+    apr_size_t size;
+    int ret;
+    int error;
+    apr_off_t max_size;         /* limit of the request that fetched it */
+    int done;
+    int refcount;
+    apr_thread_cond_t *cond;
+} sundown_flight_rec;
+#endif
+
+/* response of a fetch */
+typedef struct {
+    apr_pool_t *pool;
+    struct buf *ib;
+    apr_size_t start;           /* first byte of the body in ib */
+    apr_off_t length;           /* announced, -1 if not */
+    apr_off_t max_size;
+    int too_large;
+    char *etag;
+    char *last_modified;
+    int no_store;
+} sundown_fetch_rec;
+
+#define SUNDOWN_STYLE_HEADER                                \
+    "<!DOCTYPE html>\n<html>\n"                             \
+    "<head><title>"SUNDOWN_TITLE_DEFAULT"</title></head>\n" \
+    "<body>\n"
+#define SUNDOWN_STYLE_FOOTER "</body>\n</html>\n"
+
+static sundown_style_rec sundown_style_builtin = {
+    NULL, NULL, 0, 0, 0,
+    SUNDOWN_STYLE_HEADER, sizeof(SUNDOWN_STYLE_HEADER) - 1,
+    SUNDOWN_STYLE_FOOTER, sizeof(SUNDOWN_STYLE_FOOTER) - 1,
+    0, 0
+};
+
 module AP_MODULE_DECLARE_DATA sundown_module;
 
+static unsigned int
+sundown_extensions(void)
+{
+    unsigned int extensions = 0;
+
+#ifdef SUNDOWN_USE_FENCED_CODE
+    extensions |= MKDEXT_FENCED_CODE;
+#endif
+#ifdef SUNDOWN_USE_NO_INTRA_EMPHASIS
+    extensions |= MKDEXT_NO_INTRA_EMPHASIS;
+#endif
+#ifdef SUNDOWN_USE_AUTOLINK
+    extensions |= MKDEXT_AUTOLINK;
+#endif
+#ifdef SUNDOWN_USE_STRIKETHROUGH
+    extensions |= MKDEXT_STRIKETHROUGH;
+#endif
+#ifdef SUNDOWN_USE_LAX_HTML_BLOCKS
+    extensions |= MKDEXT_LAX_HTML_BLOCKS;
+#endif
+#ifdef SUNDOWN_USE_SPACE_HEADERS
+    extensions |= MKDEXT_SPACE_HEADERS;
+#endif
+#ifdef SUNDOWN_USE_SUPERSCRIPT
+    extensions |= MKDEXT_SUPERSCRIPT;
+#endif
+#ifdef SUNDOWN_USE_TABLES
+    extensions |= MKDEXT_TABLES;
+#endif
+#ifdef SUNDOWN_USE_SPECIAL_ATTRIBUTES
+    extensions |= MKDEXT_SPECIAL_ATTRIBUTES;
+#endif
+
+    return extensions;
+}
+
+static unsigned int
+sundown_render_flags(void)
+{
+    unsigned int flags = 0;
+
+#ifdef SUNDOWN_USE_SKIP_LINEBREAK
+    flags |= HTML_SKIP_LINEBREAK;
+#endif
+#ifdef SUNDOWN_USE_XHTML
+    flags |= HTML_USE_XHTML;
+#endif
+#ifdef SUNDOWN_TOC_SUPPORT
+    flags |= HTML_TOC;
+#endif
+#ifdef SUNDOWN_USE_TASK_LISTS
+    flags |= HTML_USE_TASK_LIST;
+#endif
+
+    return flags;
+}
+
+static sundown_cache_slot *
+sundown_cache_slot_get(apr_uint32_t hash)
+{
+    return (sundown_cache_slot *)(sundown_cache.base +
+                                  (hash % sundown_cache.entries) *
+                                  sundown_cache.slot_size);
+}
 
 static int
-output_style_header(request_rec *r, apr_file_t *fp)
+sundown_cache_get(request_rec *r, const char *key,
+                  char **data, apr_size_t *size)
+{
+    apr_ssize_t key_size = strlen(key);
+    apr_uint32_t hash;
+    sundown_cache_slot *slot;
+    int found = 0;
+
+    if (!sundown_cache.base) {
+        return 0;
+    }
+
+    hash = apr_hashfunc_default(key, &key_size);
+    slot = sundown_cache_slot_get(hash);
+
+    if (apr_global_mutex_lock(sundown_cache.mutex) != APR_SUCCESS) {
+        return 0;
+    }
+
+    if (slot->hash == hash && slot->key_size == (apr_size_t)key_size &&
+        memcmp((char *)(slot + 1), key, key_size) == 0) {
+        *size = slot->data_size;
+        *data = apr_palloc(r->pool, slot->data_size + 1);
+        memcpy(*data, (char *)(slot + 1) + key_size, slot->data_size);
+        found = 1;
+    }
+
+    apr_global_mutex_unlock(sundown_cache.mutex);
+
+    return found;
+}
+
+static void
+sundown_cache_set(request_rec *r, const char *key, struct buf **bufs, int n)
+{
+    apr_ssize_t key_size = strlen(key);
+    apr_size_t data_size = 0;
+    apr_uint32_t hash;
+    sundown_cache_slot *slot;
+    char *p;
+    int i;
+
+    if (!sundown_cache.base) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (bufs[i]) {
+            data_size += bufs[i]->size;
+        }
+    }
+
+    if (key_size + data_size > sundown_cache.entry_size) {
+        _RDEBUG(r, "cache: %s too large (%" APR_SIZE_T_FMT ")",
+                key, data_size);
+        return;
+    }
+
+    hash = apr_hashfunc_default(key, &key_size);
+    slot = sundown_cache_slot_get(hash);
+
+    if (apr_global_mutex_lock(sundown_cache.mutex) != APR_SUCCESS) {
+        return;
+    }
+
+    slot->hash = hash;
+    slot->key_size = key_size;
+    slot->data_size = data_size;
+
+    p = (char *)(slot + 1);
+    memcpy(p, key, key_size);
+    p += key_size;
+    for (i = 0; i < n; i++) {
+        if (bufs[i] && bufs[i]->size > 0) {
+            memcpy(p, bufs[i]->data, bufs[i]->size);
+            p += bufs[i]->size;
+        }
+    }
+
+    apr_global_mutex_unlock(sundown_cache.mutex);
+}
+
+
+/* style template: header up to the <body> line, footer after it */
+static apr_status_t
+style_release(void *data)
 {
-    char buf[HUGE_STRING_LEN];
-    char *lower = NULL;
+    sundown_style_rec *style = (sundown_style_rec *)data;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(sundown_styles.mutex);
+#endif
+
+    if (--style->refcount == 0 && style->stale) {
+        apr_pool_destroy(style->pool);
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(sundown_styles.mutex);
+#endif
+
+    return APR_SUCCESS;
+}
 
-    while (apr_file_gets(buf, HUGE_STRING_LEN, fp) == APR_SUCCESS) {
-        ap_rputs(buf, r);
+/* takes a template out of the table; called with the mutex held */
+static void
+style_remove(sundown_style_rec *style)
+{
+    apr_hash_set(sundown_styles.table, style->filename, APR_HASH_KEY_STRING,
+                 NULL);
+    style->stale = 1;
+    if (style->refcount == 0) {
+        apr_pool_destroy(style->pool);
+    }
+}
 
-        lower = apr_pstrdup(r->pool, buf);
+/* reads and splits the template into its pool */
+static sundown_style_rec *
+style_compile(request_rec *r, apr_pool_t *pool, const char *filename,
+              apr_finfo_t *finfo)
+{
+    apr_status_t rc;
+    apr_file_t *fp = NULL;
+    apr_size_t size = (apr_size_t)finfo->size, read = 0;
+    sundown_style_rec *style;
+    char *data, *line, *end, *lower;
+
+    style = apr_pcalloc(pool, sizeof(sundown_style_rec));
+    style->pool = pool;
+    style->filename = apr_pstrdup(pool, filename);
+    style->mtime = finfo->mtime;
+    style->size = finfo->size;
+    style->used = r->request_time;
+
+    data = apr_palloc(pool, size + 1);
+
+    rc = apr_file_open(&fp, filename, APR_READ | APR_BINARY | APR_XTHREAD,
+                       APR_OS_DEFAULT, r->pool);
+    if (rc == APR_SUCCESS) {
+        rc = apr_file_read_full(fp, data, size, &read);
+        apr_file_close(fp);
+    }
+    if (rc != APR_SUCCESS && rc != APR_EOF) {
+        _RERR(r, "style: failed to read %s", filename);
+        return NULL;
+    }
+    data[read] = '\0';
+
+    /* whole file is the header when there is no <body> line */
+    style->header = data;
+    style->header_size = read;
+    style->footer = SUNDOWN_STYLE_FOOTER;
+    style->footer_size = sizeof(SUNDOWN_STYLE_FOOTER) - 1;
+
+    lower = apr_palloc(r->pool, read + 1);
+    line = data;
+    while (line < data + read) {
+        end = memchr(line, '\n', data + read - line);
+        end = end ? end + 1 : data + read;
+
+        memcpy(lower, line, end - line);
+        lower[end - line] = '\0';
         ap_str_tolower(lower);
         if (apr_fnmatch("*"SUNDOWN_TAG"*", lower, APR_FNM_CASE_BLIND) == 0) {
-            return 1;
+            style->header_size = end - data;
+            style->footer = end;
+            style->footer_size = data + read - end;
+            break;
         }
+
+        line = end;
     }
 
-    return 0;
+    return style;
 }
 
-static apr_file_t *
-style_header(request_rec *r, sundown_config_rec *cfg, char *filename)
+/* the template of a file: keyed by its canonical path, as many paths name
+ * the same file, and read without the mutex, which is only held to look
+ * it up and to put it in the table */
+static sundown_style_rec *
+style_get(request_rec *r, const char *filename)
 {
-    apr_status_t rc = -1;
-    apr_file_t *fp = NULL;
-    char *style_filepath = NULL;
+    apr_finfo_t finfo;
+    apr_pool_t *pool = NULL;
+    sundown_style_rec *style, *compiled = NULL, *old;
+    apr_hash_index_t *hi;
+    char *path;
+
+    if (!sundown_styles.table) {
+        return NULL;
+    }
 
-    if (filename == NULL && cfg->style_default != NULL) {
-        filename = cfg->style_default;
+    if (apr_filepath_merge(&path, NULL, filename, APR_FILEPATH_TRUENAME,
+                           r->pool) != APR_SUCCESS ||
+        apr_stat(&finfo, path, APR_FINFO_MTIME | APR_FINFO_SIZE |
+                 APR_FINFO_TYPE, r->pool) != APR_SUCCESS ||
+        finfo.filetype != APR_REG) {
+        return NULL;
     }
 
-    if (filename != NULL) {
-        if (cfg->style_path == NULL) {
-            ap_add_common_vars(r);
-            cfg->style_path = (char *)apr_table_get(r->subprocess_env,
-                                                    "DOCUMENT_ROOT");
-        }
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(sundown_styles.mutex);
+#endif
+
+    style = apr_hash_get(sundown_styles.table, path, APR_HASH_KEY_STRING);
+    if (style && (style->mtime != finfo.mtime || style->size != finfo.size)) {
+        style_remove(style);
+        style = NULL;
+    }
+    if (style) {
+        style->refcount++;
+        style->used = r->request_time;
+    } else if (apr_pool_create(&pool, sundown_styles.pool) != APR_SUCCESS) {
+        pool = NULL;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(sundown_styles.mutex);
+#endif
 
-        style_filepath = apr_psprintf(r->pool, "%s/%s%s",
-                                      cfg->style_path, filename, cfg->style_ext);
+    if (pool) {
+        compiled = style_compile(r, pool, path, &finfo);
 
-        rc = apr_file_open(&fp, style_filepath,
-                           APR_READ | APR_BINARY | APR_XTHREAD,
-                           APR_OS_DEFAULT, r->pool);
-        if (rc == APR_SUCCESS) {
-            if (output_style_header(r, fp) != 1) {
-                apr_file_close(fp);
-                fp = NULL;
-            }
+#if APR_HAS_THREADS
+        apr_thread_mutex_lock(sundown_styles.mutex);
+#endif
+
+        /* another request may have put it in meanwhile */
+        style = apr_hash_get(sundown_styles.table, path, APR_HASH_KEY_STRING);
+        if (compiled && style && (style->mtime != finfo.mtime ||
+                                  style->size != finfo.size)) {
+            style_remove(style);
+            style = NULL;
+        }
+
+        if (style || !compiled) {
+            apr_pool_destroy(pool);
         } else {
-            style_filepath = apr_psprintf(r->pool, "%s/%s%s",
-                                          cfg->style_path,
-                                          cfg->style_default,
-                                          cfg->style_ext);
-
-            rc = apr_file_open(&fp, style_filepath,
-                               APR_READ | APR_BINARY | APR_XTHREAD,
-                               APR_OS_DEFAULT, r->pool);
-            if (rc == APR_SUCCESS) {
-                if (output_style_header(r, fp) != 1) {
-                    apr_file_close(fp);
-                    fp = NULL;
+            if (apr_hash_count(sundown_styles.table) >=
+                SUNDOWN_STYLE_ENTRIES) {
+                /* the least recently used template makes room */
+                old = NULL;
+                for (hi = apr_hash_first(NULL, sundown_styles.table); hi;
+                     hi = apr_hash_next(hi)) {
+                    sundown_style_rec *entry;
+
+                    apr_hash_this(hi, NULL, NULL, (void **)&entry);
+                    if (!old || entry->used < old->used) {
+                        old = entry;
+                    }
+                }
+                if (old) {
+                    style_remove(old);
                 }
             }
+            style = compiled;
+            apr_hash_set(sundown_styles.table, style->filename,
+                         APR_HASH_KEY_STRING, style);
+        }
+
+        if (style) {
+            style->refcount++;
+            style->used = r->request_time;
         }
+
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock(sundown_styles.mutex);
+#endif
     }
 
-    if (rc != APR_SUCCESS) {
-        ap_rputs("<!DOCTYPE html>\n<html>\n", r);
-        ap_rputs("<head><title>"SUNDOWN_TITLE_DEFAULT"</title></head>\n", r);
-        ap_rputs("<body>\n", r);
+    if (style) {
+        apr_pool_cleanup_register(r->pool, style, style_release,
+                                  apr_pool_cleanup_null);
     }
 
-    return fp;
+    return style;
 }
 
-static int
-style_footer(request_rec *r, apr_file_t *fp) {
-    char buf[HUGE_STRING_LEN];
+static void
+style_output(request_rec *r, const char *data, apr_size_t size)
+{
+    apr_bucket_brigade *bb;
+
+    if (size == 0) {
+        return;
+    }
+
+    bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_transient_create(
+                                data, size, r->connection->bucket_alloc));
+    ap_pass_brigade(r->output_filters, bb);
+}
+
+static sundown_style_rec *
+style_lookup(request_rec *r, sundown_config_rec *cfg, char *filename)
+{
+    sundown_style_rec *style = NULL;
+    char *style_path = cfg->style_path;
+
+    if (filename == NULL && cfg->style_default != NULL) {
+        filename = cfg->style_default;
+    }
 
-    if (fp != NULL) {
-        while (apr_file_gets(buf, HUGE_STRING_LEN, fp) == APR_SUCCESS) {
-            ap_rputs(buf, r);
+    if (filename != NULL) {
+        if (style_path == NULL) {
+            ap_add_common_vars(r);
+            style_path = (char *)apr_table_get(r->subprocess_env,
+                                               "DOCUMENT_ROOT");
         }
-        apr_file_close(fp);
-    } else {
-        ap_rputs("</body>\n</html>\n", r);
+
+        style = style_get(r, apr_psprintf(r->pool, "%s/%s%s", style_path,
+                                          filename, cfg->style_ext));
+        if (!style && cfg->style_default) {
+            style = style_get(r, apr_psprintf(r->pool, "%s/%s%s",
+                                              style_path, cfg->style_default,
+                                              cfg->style_ext));
+        }
+    }
+
+    if (!style) {
+        style = &sundown_style_builtin;
     }
 
+    return style;
+}
+
+static int
+style_header(request_rec *r, sundown_style_rec *style)
+{
+    style_output(r, style->header, style->header_size);
+
+    return 0;
+}
+
+static int
+style_footer(request_rec *r, sundown_style_rec *style) {
+    style_output(r, style->footer, style->footer_size);
+
     return 0;
 }
 
+/* the whole page in one brigade, its length set before it is sent */
 static void
-append_data(struct buf *ib, void *buffer, size_t size)
+style_page(request_rec *r, sundown_style_rec *style, struct buf *toc,
+           const char *body, apr_size_t body_size)
 {
-    size_t offset = 0;
+    apr_bucket_alloc_t *ba = r->connection->bucket_alloc;
+    apr_bucket_brigade *bb;
+    apr_off_t length = style->header_size + style->footer_size + body_size;
 
-    if (!ib || !buffer || size == 0) {
+    if (toc) {
+        length += toc->size;
+    }
+    ap_set_content_length(r, length);
+
+    /* HEAD: the length is all there is to send */
+    if (r->header_only) {
         return;
     }
 
-    while (offset < size) {
-        size_t bufsize = ib->asize - ib->size;
-        if (size >= (bufsize + offset)) {
-            memcpy(ib->data + ib->size, buffer + offset, bufsize);
-            ib->size += bufsize;
-            bufgrow(ib, ib->size + SUNDOWN_READ_UNIT);
-            offset += bufsize;
-        } else {
-            bufsize = size - offset;
-            if (bufsize > 0) {
-                memcpy(ib->data + ib->size, buffer + offset, bufsize);
-                ib->size += bufsize;
-            }
-            break;
-        }
+    bb = apr_brigade_create(r->pool, ba);
+    if (style->header_size > 0) {
+        APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_transient_create(
+                                    style->header, style->header_size, ba));
     }
+    if (toc && toc->size > 0) {
+        APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_transient_create(
+                                    (const char *)toc->data, toc->size, ba));
+    }
+    if (body_size > 0) {
+        APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_transient_create(
+                                    body, body_size, ba));
+    }
+    if (style->footer_size > 0) {
+        APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_transient_create(
+                                    style->footer, style->footer_size, ba));
+    }
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(ba));
+
+    ap_pass_brigade(r->output_filters, bb);
+}
+
+static void
+append_data(struct buf *ib, void *buffer, size_t size)
+{
+    if (!ib || !buffer || size == 0) {
+        return;
+    }
+
+    bufput(ib, buffer, size);
 }
 
 static size_t
 append_url_data(void *buffer, size_t size, size_t nmemb, void *user)
 {
     size_t segsize = size * nmemb;
-    struct buf *ib = (struct buf *)user;
+    sundown_fetch_rec *fetch = (sundown_fetch_rec *)user;
+    struct buf *ib = fetch->ib;
+    apr_size_t received = ib->size - fetch->start;
+
+    /* stop the transfer once the document is too large */
+    if (fetch->max_size > 0 &&
+        (apr_off_t)(received + segsize) > fetch->max_size) {
+        fetch->too_large = 1;
+        return 0;
+    }
+
+    /* the announced length is reserved at once */
+    if (received == 0 && fetch->length > 0 &&
+        (fetch->max_size <= 0 || fetch->length <= fetch->max_size)) {
+        bufreserve(ib, (size_t)fetch->length);
+    }
 
     append_data(ib, buffer, segsize);
 
+    /* stop the transfer once the input no longer fits */
+    if (ib->error != BUF_OK) {
+        return 0;
+    }
+
     return segsize;
 }
 
 static int
-append_page_data(request_rec *r, sundown_config_rec *cfg,
-                 struct buf *ib, char *name, int directory)
+page_filename(request_rec *r, sundown_config_rec *cfg,
+              char *name, int directory, char **filename)
 {
-    apr_status_t rc = -1;
-    apr_file_t *fp = NULL;
-    apr_size_t read;
-    char *filename = NULL;
-
     if (name == NULL) {
         if (!cfg->page_default) {
             return HTTP_NOT_FOUND;
         }
-        filename = cfg->page_default;
+        *filename = cfg->page_default;
     } else if (strlen(name) <= 0 ||
                memcmp(name + strlen(name) - 1, "/", 1) == 0) {
         if (!cfg->directory_index || !directory) {
             return HTTP_FORBIDDEN;
         }
-        filename = apr_psprintf(r->pool, "%s%s", name, cfg->directory_index);
+        *filename = apr_psprintf(r->pool, "%s%s", name, cfg->directory_index);
     } else {
-        filename = name;
+        *filename = name;
     }
 
-    rc = apr_file_open(&fp, filename,
-                       APR_READ | APR_BINARY | APR_XTHREAD, APR_OS_DEFAULT,
-                       r->pool);
-    if (rc != APR_SUCCESS || !fp) {
-        switch (errno) {
-            case ENOENT:
-                return HTTP_NOT_FOUND;
-            case EACCES:
-                return HTTP_FORBIDDEN;
-            default:
-                break;
+    return APR_SUCCESS;
+}
+
+static int
+page_stat(request_rec *r, sundown_config_rec *cfg, int directory,
+          char **filename, apr_finfo_t *finfo)
+{
+    /* same lookup order as reading: request file, then default page */
+    if (page_filename(r, cfg, r->filename, directory,
+                      filename) == APR_SUCCESS) {
+        if (*filename == r->filename && r->finfo.filetype == APR_REG &&
+            r->finfo.size > 0) {
+            *finfo = r->finfo;
+            return APR_SUCCESS;
+        }
+        if (apr_stat(finfo, *filename, APR_FINFO_MTIME | APR_FINFO_SIZE,
+                     r->pool) == APR_SUCCESS && finfo->size > 0) {
+            return APR_SUCCESS;
         }
-        return HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    do {
-        rc = apr_file_read_full(fp, ib->data + ib->size, ib->asize - ib->size,
-                                &read);
-        if (read > 0) {
-            ib->size += read;
-            bufgrow(ib, ib->size + SUNDOWN_READ_UNIT);
-        }
-    } while (rc != APR_EOF);
+    if (page_filename(r, cfg, NULL, 0, filename) != APR_SUCCESS) {
+        return HTTP_NOT_FOUND;
+    }
 
-    apr_file_close(fp);
+    if (apr_stat(finfo, *filename, APR_FINFO_MTIME | APR_FINFO_SIZE,
+                 r->pool) != APR_SUCCESS) {
+        return HTTP_NOT_FOUND;
+    }
 
     return APR_SUCCESS;
 }
 
+static char *
+sundown_page_key(request_rec *r, sundown_config_rec *cfg,
+                 int directory, char *toc, apr_finfo_t *finfo)
+{
+    char *filename = NULL;
+
+    if (page_stat(r, cfg, directory, &filename, finfo) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    /* the style layout is written outside of the cached body */
+    return apr_psprintf(r->pool,
+                        "%s\n%" APR_TIME_T_FMT "\n%" APR_OFF_T_FMT
+                        "\n%s\n%x\n%x\n%s\n%s\n%s\n%d",
+                        filename, finfo->mtime, finfo->size,
+                        toc ? toc : "", sundown_extensions(),
+                        sundown_render_flags(),
+                        cfg->class_ul ? cfg->class_ul : "",
+                        cfg->class_ol ? cfg->class_ol : "",
+                        cfg->class_task ? cfg->class_task : "",
+                        cfg->max_nesting > 0 ?
+                        cfg->max_nesting : SUNDOWN_MAX_NESTING);
+}
+
+static int
+sundown_validators(request_rec *r, const char *key,
+                   apr_finfo_t *finfo, sundown_style_rec *layout)
+{
+    char *layout_key;
+    apr_ssize_t len;
+    apr_uint32_t hash;
+
+    /* page key (file, flags, toc, classes, nesting) and the style
+     * template */
+    layout_key = apr_psprintf(r->pool, "%s\n%s\n%" APR_TIME_T_FMT
+                              "\n%" APR_OFF_T_FMT, key,
+                              layout->filename ? layout->filename : "",
+                              layout->mtime, layout->size);
+    len = strlen(layout_key);
+    hash = apr_hashfunc_default(layout_key, &len);
+
+    apr_table_setn(r->headers_out, "ETag",
+                   apr_psprintf(r->pool, "\"%" APR_UINT64_T_HEX_FMT
+                                "-%" APR_UINT64_T_HEX_FMT "-%08x\"",
+                                (apr_uint64_t)finfo->size,
+                                (apr_uint64_t)finfo->mtime, hash));
+
+    ap_update_mtime(r, finfo->mtime);
+    if (layout->filename) {
+        ap_update_mtime(r, layout->mtime);
+    }
+    ap_set_last_modified(r);
+
+    return ap_meets_conditions(r);
+}
+
+static int
+page_open(request_rec *r, char *filename,
+          apr_file_t **fp, apr_finfo_t *finfo)
+{
+    apr_status_t rc;
+
+    rc = apr_file_open(fp, filename,
+                       APR_READ | APR_BINARY | APR_XTHREAD, APR_OS_DEFAULT,
+                       r->pool);
+    if (rc != APR_SUCCESS || !*fp) {
+        switch (errno) {
+            case ENOENT:
+                return HTTP_NOT_FOUND;
+            case EACCES:
+                return HTTP_FORBIDDEN;
+            default:
+                break;
+        }
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (apr_file_info_get(finfo, APR_FINFO_SIZE, *fp) != APR_SUCCESS) {
+        finfo->size = 0;
+    }
+
+    return APR_SUCCESS;
+}
+
+static int
+append_page_data(request_rec *r, sundown_config_rec *cfg,
+                 struct buf *ib, char *name, int directory)
+{
+    apr_status_t rc = -1;
+    apr_file_t *fp = NULL;
+    apr_finfo_t finfo;
+    apr_size_t read;
+    char *filename = NULL;
+
+    rc = page_filename(r, cfg, name, directory, &filename);
+    if (rc != APR_SUCCESS) {
+        return rc;
+    }
+
+    rc = page_open(r, filename, &fp, &finfo);
+    if (rc != APR_SUCCESS) {
+        return rc;
+    }
+
+    /* whole file in one allocation */
+    if (finfo.size > 0) {
+        bufreserve(ib, (size_t)finfo.size);
+    }
+
+    do {
+        if (ib->size >= ib->asize) {
+            int err = bufgrow(ib, ib->size + SUNDOWN_READ_UNIT);
+            if (err != BUF_OK) {
+                ib->error = err;
+                break;
+            }
+        }
+        rc = apr_file_read_full(fp, ib->data + ib->size, ib->asize - ib->size,
+                                &read);
+        ib->size += read;
+    } while (rc == APR_SUCCESS);
+
+    apr_file_close(fp);
+
+    return APR_SUCCESS;
+}
+
+/* read-only mapping of the page, used when it is the only source */
+static int
+map_page_data(request_rec *r, sundown_config_rec *cfg,
+              struct buf *page, char *name, int directory)
+{
+#if APR_HAS_MMAP
+    apr_status_t rc;
+    apr_file_t *fp = NULL;
+    apr_finfo_t finfo;
+    apr_mmap_t *mm = NULL;
+    char *filename = NULL;
+    core_dir_config *core;
+
+    core = ap_get_module_config(r->per_dir_config, &core_module);
+    if (core->enable_mmap == ENABLE_MMAP_OFF) {
+        return APR_ENOTIMPL;
+    }
+
+    if (page_filename(r, cfg, name, directory, &filename) != APR_SUCCESS ||
+        page_open(r, filename, &fp, &finfo) != APR_SUCCESS) {
+        return APR_ENOENT;
+    }
+
+    if (finfo.size <= 0) {
+        apr_file_close(fp);
+        return APR_ENOENT;
+    }
+
+    rc = apr_mmap_create(&mm, fp, 0, (apr_size_t)finfo.size,
+                         APR_MMAP_READ, r->pool);
+    apr_file_close(fp);
+    if (rc != APR_SUCCESS) {
+        return rc;
+    }
+
+    page->data = mm->mm;
+    page->size = mm->size;
+    page->asize = 0;
+    page->unit = 0;
+
+    return APR_SUCCESS;
+#else
+    return APR_ENOTIMPL;
+#endif
+}
+
+#ifdef SUNDOWN_RAW_SUPPORT
+/* the page as it is: the file is handed to the core output filter, which
+ * sends it with sendfile or mmap when they are enabled */
+static int
+sundown_raw_page(request_rec *r, sundown_config_rec *cfg, int directory)
+{
+    apr_bucket_brigade *bb;
+    apr_bucket *e;
+    apr_file_t *fp = NULL;
+    apr_finfo_t finfo;
+    apr_int32_t flags = APR_READ | APR_BINARY;
+    char *filename = NULL;
+    core_dir_config *core;
+    int ret;
+
+    ret = page_stat(r, cfg, directory, &filename, &finfo);
+    if (ret != APR_SUCCESS) {
+        return ret;
+    }
+
+    core = ap_get_module_config(r->per_dir_config, &core_module);
+#if APR_HAS_SENDFILE
+    if (core->enable_sendfile == ENABLE_SENDFILE_ON) {
+        flags |= APR_SENDFILE_ENABLED;
+    }
+#endif
+
+    if (apr_file_open(&fp, filename, flags, APR_OS_DEFAULT,
+                      r->pool) != APR_SUCCESS) {
+        return HTTP_NOT_FOUND;
+    }
+
+    /* validators of the file that was opened */
+    if (apr_file_info_get(&finfo, APR_FINFO_MTIME | APR_FINFO_SIZE,
+                          fp) != APR_SUCCESS) {
+        apr_file_close(fp);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->content_type = "text/plain";
+    apr_table_setn(r->headers_out, "ETag",
+                   apr_psprintf(r->pool, "\"%" APR_UINT64_T_HEX_FMT
+                                "-%" APR_UINT64_T_HEX_FMT "-raw\"",
+                                (apr_uint64_t)finfo.size,
+                                (apr_uint64_t)finfo.mtime));
+    ap_update_mtime(r, finfo.mtime);
+    ap_set_last_modified(r);
+
+    ret = ap_meets_conditions(r);
+    if (ret != OK) {
+        apr_file_close(fp);
+        return ret;
+    }
+
+    ap_set_content_length(r, finfo.size);
+    if (r->header_only || finfo.size == 0) {
+        apr_file_close(fp);
+        return OK;
+    }
+
+    bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    e = apr_brigade_insert_file(bb, fp, 0, finfo.size, r->pool);
+#if APR_HAS_MMAP
+    if (core->enable_mmap == ENABLE_MMAP_OFF) {
+        apr_bucket_file_enable_mmap(e, 0);
+    }
+#endif
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(
+                                r->connection->bucket_alloc));
+
+    if (ap_pass_brigade(r->output_filters, bb) != APR_SUCCESS) {
+        return AP_FILTER_ERROR;
+    }
+
+    return OK;
+}
+#endif
+
+/* request buffers: allocated from the request pool, released with it */
+static void *
+sundown_pool_realloc(void *opaque, void *ptr, size_t size, size_t neosize)
+{
+    void *data;
+
+    if (ptr && neosize <= size) {
+        return ptr;
+    }
+
+    data = apr_palloc((apr_pool_t *)opaque, neosize);
+    if (data && ptr) {
+        memcpy(data, ptr, size);
+    }
+
+    return data;
+}
+
+static const struct buf_allocator *
+sundown_pool_allocator(request_rec *r)
+{
+    struct buf_allocator *allocator;
+
+    allocator = ap_get_module_config(r->request_config, &sundown_module);
+    if (!allocator) {
+        allocator = apr_pcalloc(r->pool, sizeof(struct buf_allocator));
+        allocator->realloc = sundown_pool_realloc;
+        allocator->opaque = r->pool;
+        ap_set_module_config(r->request_config, &sundown_module, allocator);
+    }
+
+    return allocator;
+}
+
+static struct buf *
+sundown_bufnew(request_rec *r, apr_size_t unit, apr_size_t limit)
+{
+    struct buf *buf;
+
+    buf = bufnew_alloc(unit, sundown_pool_allocator(r));
+    if (buf) {
+        bufsetgrowth(buf, BUF_GROW_GEOMETRIC);
+        bufsetlimit(buf, limit);
+    }
+
+    return buf;
+}
+
+static void
+sundown_parser_forget(sundown_parser_rec *parser)
+{
+    if (parser->document) {
+        sd_document_free(parser->document);
+        parser->document = NULL;
+    }
+    if (parser->document_key) {
+        free(parser->document_key);
+        parser->document_key = NULL;
+    }
+}
+
+static apr_status_t
+sundown_parser_cleanup(void *data)
+{
+    sundown_parser_rec *parser = (sundown_parser_rec *)data;
+
+    if (parser->markdown) {
+        sd_markdown_free(parser->markdown);
+        parser->markdown = NULL;
+    }
+    if (parser->arena) {
+        sd_arena_free(parser->arena);
+        parser->arena = NULL;
+    }
+    sundown_parser_forget(parser);
+
+    return APR_SUCCESS;
+}
+
+#if APR_HAS_THREADS
+static void
+sundown_parser_destroy(void *data)
+{
+    sundown_parser_rec *parsers = (sundown_parser_rec *)data;
+    int i;
+
+    for (i = 0; i < SUNDOWN_PARSER_MAX; i++) {
+        sundown_parser_cleanup(&parsers[i]);
+    }
+    free(parsers);
+}
+#endif
+
+static apr_status_t
+sundown_parser_release(void *data)
+{
+    sundown_parser_rec *parser = (sundown_parser_rec *)data;
+
+    /* only a local page is kept for the next request */
+    if (!parser->document_key) {
+        sundown_parser_forget(parser);
+    }
+    if (parser->arena) {
+        sd_arena_reset(parser->arena);
+    }
+    parser->busy = 0;
+
+    return APR_SUCCESS;
+}
+
+static sundown_parser_rec *
+sundown_parser_get(request_rec *r, int kind,
+                   unsigned int extensions, unsigned int flags, int nesting)
+{
+    sundown_parser_rec *parsers = NULL, *parser = NULL;
+    const struct buf_allocator *allocator = NULL;
+
+#if APR_HAS_THREADS
+    if (sundown_parser_key) {
+        apr_threadkey_private_get((void **)&parsers, sundown_parser_key);
+        if (!parsers) {
+            parsers = calloc(SUNDOWN_PARSER_MAX, sizeof(sundown_parser_rec));
+            if (parsers &&
+                apr_threadkey_private_set(parsers,
+                                          sundown_parser_key) != APR_SUCCESS) {
+                free(parsers);
+                parsers = NULL;
+            }
+        }
+        /* a subrequest rendered from an output filter */
+        if (parsers && !parsers[kind].busy) {
+            parser = &parsers[kind];
+        }
+    }
+#endif
+
+    /* not kept: released with the request */
+    if (!parser) {
+        allocator = sundown_pool_allocator(r);
+        parser = apr_pcalloc(r->pool, sizeof(sundown_parser_rec));
+        apr_pool_cleanup_register(r->pool, parser, sundown_parser_cleanup,
+                                  apr_pool_cleanup_null);
+    }
+
+    if (parser->markdown &&
+        (parser->extensions != extensions || parser->flags != flags ||
+         parser->nesting != nesting)) {
+        sd_markdown_free(parser->markdown);
+        parser->markdown = NULL;
+    }
+
+    sdhtml_renderer(&parser->callbacks, &parser->options, flags);
+
+    if (parser->markdown) {
+        sd_markdown_reset(parser->markdown, SUNDOWN_PARSER_KEEP);
+    } else {
+        parser->markdown = sd_markdown_new_alloc(extensions, nesting,
+                                                 &parser->callbacks,
+                                                 &parser->options,
+                                                 allocator);
+        if (!parser->markdown) {
+            return NULL;
+        }
+        parser->extensions = extensions;
+        parser->flags = flags;
+        parser->nesting = nesting;
+    }
+
+    parser->busy = 1;
+    apr_pool_cleanup_register(r->pool, parser, sundown_parser_release,
+                              apr_pool_cleanup_null);
+
+    return parser;
+}
+
+/* preprocessed page: reused while the file (key) is unchanged */
+static struct sd_document *
+sundown_parser_document(request_rec *r, sundown_parser_rec *parser,
+                        const char *key, struct buf *ib, apr_size_t limit)
+{
+    apr_size_t len = 0;
+    int n = 0;
+
+    /* the page key starts with the file name, mtime and size */
+    if (key) {
+        while (key[len] && (key[len] != '\n' || ++n < 3)) {
+            len++;
+        }
+    }
+
+    if (parser->document) {
+        if (len && parser->document_key &&
+            strlen(parser->document_key) == len &&
+            memcmp(parser->document_key, key, len) == 0) {
+            _RDEBUG(r, "reuse document (%" APR_SIZE_T_FMT ")", len);
+            return parser->document;
+        }
+        sundown_parser_forget(parser);
+    }
+
+    /* a page without a key is not kept */
+    if (!len) {
+        parser->document = sd_document_new_alloc(ib->data, ib->size, limit,
+                                                 sundown_pool_allocator(r));
+        return parser->document;
+    }
+
+    parser->document = sd_document_new(ib->data, ib->size, limit);
+    if (parser->document &&
+        sd_document_size(parser->document) <= SUNDOWN_DOCUMENT_KEEP) {
+        parser->document_key = strndup(key, len);
+    }
+
+    return parser->document;
+}
+
+/* streamed body: completed blocks are passed down the filter chain */
+static void
+sundown_stream_flush(const uint8_t *data, size_t size, void *opaque)
+{
+    sundown_stream_rec *stream = (sundown_stream_rec *)opaque;
+    request_rec *r = stream->r;
+
+    if (stream->capture) {
+        if (stream->capture->size + size > stream->capture_max) {
+            stream->capture = NULL;
+        } else {
+            bufput(stream->capture, data, size);
+        }
+    }
+
+    APR_BRIGADE_INSERT_TAIL(stream->bb, apr_bucket_transient_create(
+                                (const char *)data, size,
+                                r->connection->bucket_alloc));
+    ap_pass_brigade(r->output_filters, stream->bb);
+    apr_brigade_cleanup(stream->bb);
+}
+
+/* streamed page that failed: what is out is sent, and the response is
+ * left unterminated (no last chunk) so the client sees it is incomplete */
+static void
+sundown_stream_abort(sundown_stream_rec *stream, int status)
+{
+    request_rec *r = stream->r;
+    conn_rec *c = r->connection;
+
+    APR_BRIGADE_INSERT_TAIL(stream->bb, ap_bucket_error_create(
+                                status, NULL, r->pool, c->bucket_alloc));
+    APR_BRIGADE_INSERT_TAIL(stream->bb,
+                            apr_bucket_flush_create(c->bucket_alloc));
+    ap_pass_brigade(r->output_filters, stream->bb);
+    apr_brigade_cleanup(stream->bb);
+
+    c->aborted = 1;
+    c->keepalive = AP_CONN_CLOSE;
+}
+
+static int
+sundown_buffer_error(request_rec *r, int err)
+{
+    if (err == SD_EBUDGET) {
+        SUNDOWN_STATS_INC(work_limit);
+        _RINFO(r, "work budget exceeded: %s", r->filename);
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    if (err == BUF_ELIMIT) {
+        SUNDOWN_STATS_INC(buffer_limit);
+        _RINFO(r, "buffer limit exceeded: %s", r->filename);
+        return HTTP_REQUEST_ENTITY_TOO_LARGE;
+    }
+
+    SUNDOWN_STATS_INC(buffer_nomem);
+    _RERR(r, "buffer allocation failed: %s", r->filename);
+    return HTTP_INTERNAL_SERVER_ERROR;
+}
+
+static int
+sundown_input_error(request_rec *r)
+{
+    SUNDOWN_STATS_INC(input_limit);
+    _RINFO(r, "input size exceeded: %s", r->filename);
+    return HTTP_REQUEST_ENTITY_TOO_LARGE;
+}
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC
+sundown_segment_render(apr_thread_t *thread, void *data)
+{
+    sundown_segment_rec *seg = (sundown_segment_rec *)data;
+    sundown_join_rec *join = seg->join;
+    struct sd_callbacks callbacks;
+    struct html_renderopt options;
+    struct sd_markdown *markdown = NULL;
+
+    /* once the request thread is done with the first range, it renders
+     * the ranges not started yet itself */
+    apr_thread_mutex_lock(join->mutex);
+    if (join->closed) {
+        apr_thread_mutex_unlock(join->mutex);
+        return NULL;
+    }
+    join->running++;
+    apr_thread_mutex_unlock(join->mutex);
+
+    /* the callbacks render with the copy of the request options */
+    sdhtml_renderer(&callbacks, &options, seg->options.flags);
+
+    seg->ob = bufnew(SUNDOWN_OUTPUT_UNIT);
+    if (seg->options.toc_data.entries) {
+        seg->entries = sdhtml_toc_new(bufnew(SUNDOWN_OUTPUT_UNIT));
+        seg->options.toc_data.entries = seg->entries;
+    }
+    seg->options.toc_data.header_count = seg->base;
+
+    if (seg->ob && (seg->entries || !seg->join->entries)) {
+        markdown = sd_markdown_new(seg->extensions, seg->nesting,
+                                   &callbacks, &seg->options);
+    }
+    if (markdown) {
+        bufsetgrowth(seg->ob, BUF_GROW_GEOMETRIC);
+        bufsetlimit(seg->ob, seg->max_buffer_size);
+        sd_markdown_set_buffer_limit(markdown, seg->max_buffer_size);
+        if (seg->entries) {
+            sd_markdown_set_header_text(markdown, sdhtml_toc_collect,
+                                        &seg->options);
+        }
+        if (seg->max_work > 0) {
+            sd_markdown_set_work_budget(markdown, (size_t)seg->max_work);
+        }
+
+        seg->err = sd_markdown_render_range(seg->ob, seg->document, markdown,
+                                            seg->begin, seg->end, &seg->next);
+        seg->headers = seg->options.toc_data.header_count - seg->base;
+        seg->spent = sd_markdown_work_spent(markdown);
+
+        sd_markdown_free(markdown);
+    }
+
+    apr_thread_mutex_lock(join->mutex);
+    if (--join->running == 0) {
+        apr_thread_cond_signal(join->cond);
+    }
+    apr_thread_mutex_unlock(join->mutex);
+
+    return NULL;
+}
+#endif
+
+/* renders the document split at likely block starts: the first range in
+ * the request thread, the others on the thread pool. A range is used when
+ * it starts where the output so far stops and numbers its headers from
+ * the right count, otherwise that part is rendered again here. The ranges
+ * get a share of the work budget and the steps of those used are counted
+ * against the request's */
+static int
+sundown_render_parallel(request_rec *r, sundown_config_rec *cfg,
+                        sundown_parser_rec *parser,
+                        const struct sd_document *document, struct buf *ob)
+{
+#if APR_HAS_THREADS
+    struct sdhtml_toc *entries = parser->options.toc_data.entries;
+    size_t length = sd_document_length(document);
+    size_t *offsets, *headers, count, pos, i;
+    sundown_segment_rec *segs;
+    sundown_join_rec join;
+    int numbered, start, err;
+
+    if (!sundown_parallel.pool || length < sundown_parallel.min_size) {
+        return sd_markdown_render_document(ob, document, parser->markdown);
+    }
+
+    offsets = apr_palloc(r->pool, sizeof(size_t) * sundown_parallel.threads);
+    headers = apr_palloc(r->pool, sizeof(size_t) * sundown_parallel.threads);
+    count = sd_document_split(document, offsets, headers,
+                              sundown_parallel.threads);
+    if (count == 0 ||
+        apr_thread_mutex_create(&join.mutex, APR_THREAD_MUTEX_DEFAULT,
+                                r->pool) != APR_SUCCESS ||
+        apr_thread_cond_create(&join.cond, r->pool) != APR_SUCCESS) {
+        return sd_markdown_render_document(ob, document, parser->markdown);
+    }
+    join.running = 0;
+    join.closed = 0;
+    join.entries = entries != NULL;
+
+    /* the header count only matters when headers get ids */
+    numbered = (parser->options.flags & HTML_TOC) || entries;
+    start = parser->options.toc_data.header_count;
+
+    segs = apr_pcalloc(r->pool, sizeof(sundown_segment_rec) * (count + 1));
+    segs[0].end = offsets[0];
+
+    for (i = 1; i <= count; i++) {
+        sundown_segment_rec *seg = &segs[i];
+
+        seg->document = document;
+        seg->options = parser->options;
+        seg->extensions = parser->extensions;
+        seg->nesting = parser->nesting;
+        seg->max_buffer_size = cfg->max_buffer_size;
+        seg->begin = offsets[i - 1];
+        seg->end = i < count ? offsets[i] : length;
+        if (cfg->max_work > 0) {
+            /* a share of the budget by length, at least one step */
+            seg->max_work = (apr_off_t)((double)cfg->max_work *
+                                        (seg->end - seg->begin) / length);
+            if (seg->max_work < 1) {
+                seg->max_work = 1;
+            }
+        }
+        seg->base = start + (numbered ? (int)headers[i - 1] : 0);
+        seg->err = BUF_ENOMEM;
+        seg->join = &join;
+
+        /* a range not queued is rendered again below */
+        apr_thread_pool_push(sundown_parallel.pool, sundown_segment_render,
+                             seg, APR_THREAD_TASK_PRIORITY_NORMAL, &join);
+    }
+
+    err = sd_markdown_render_range(ob, document, parser->markdown,
+                                   0, segs[0].end, &pos);
+
+    /* the ranges started read the document: wait for them, and take back
+     * those still queued to render them again below */
+    apr_thread_mutex_lock(join.mutex);
+    join.closed = 1;
+    while (join.running > 0) {
+        apr_thread_cond_wait(join.cond, join.mutex);
+    }
+    apr_thread_mutex_unlock(join.mutex);
+    apr_thread_pool_tasks_cancel(sundown_parallel.pool, &join);
+
+    i = 1;
+    while (err == BUF_OK && pos < length) {
+        sundown_segment_rec *seg;
+        size_t stop;
+
+        while (i <= count && segs[i].begin < pos) {
+            i++;
+        }
+        seg = i <= count ? &segs[i] : NULL;
+
+        /* a range is rendered after output of the ranges before it */
+        if (seg && seg->begin == pos && seg->err == BUF_OK && ob->size &&
+            seg->base == parser->options.toc_data.header_count) {
+            if (!sd_markdown_spend_work(parser->markdown, seg->spent)) {
+                err = SD_EBUDGET;
+                break;
+            }
+            bufput(ob, seg->ob->data, seg->ob->size);
+            if (entries) {
+                sdhtml_toc_append(entries, seg->entries, 0,
+                                  seg->entries->size);
+            }
+            parser->options.toc_data.header_count += seg->headers;
+            pos = seg->next;
+            err = ob->error;
+            i++;
+            continue;
+        }
+
+        /* up to the start of the next range that may still be used */
+        if (seg && seg->begin > pos) {
+            stop = seg->begin;
+        } else {
+            stop = i < count ? segs[i + 1].begin : length;
+        }
+        _RDEBUG(r, "parallel: render again %" APR_SIZE_T_FMT
+                "-%" APR_SIZE_T_FMT, pos, stop);
+
+        /* nothing rendered so far: the blocks before it give no output
+         * and are rendered again so that this one comes out first */
+        err = sd_markdown_render_range(ob, document, parser->markdown,
+                                       ob->size ? pos : 0, stop, &pos);
+    }
+
+    for (i = 1; i <= count; i++) {
+        bufrelease(segs[i].ob);
+        sdhtml_toc_free(segs[i].entries);
+    }
+
+    return err;
+#else
+    return sd_markdown_render_document(ob, document, parser->markdown);
+#endif
+}
+
+static apr_status_t
+blockmap_entries_free(void *data)
+{
+    sdhtml_toc_free((struct sdhtml_toc *)data);
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+blockmap_release(void *data)
+{
+    sundown_blockmap_rec *map = (sundown_blockmap_rec *)data;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(sundown_blockmaps.mutex);
+#endif
+
+    if (--map->refcount == 0 && map->stale) {
+        apr_pool_destroy(map->pool);
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(sundown_blockmaps.mutex);
+#endif
+
+    return APR_SUCCESS;
+}
+
+/* takes a map out of the table; called with the mutex held */
+static void
+blockmap_remove(sundown_blockmap_rec *map)
+{
+    apr_hash_set(sundown_blockmaps.table, map->filename,
+                 APR_HASH_KEY_STRING, NULL);
+    map->stale = 1;
+    if (map->refcount == 0) {
+        apr_pool_destroy(map->pool);
+    }
+}
+
+static sundown_blockmap_rec *
+blockmap_get(request_rec *r, const char *filename, const char *options)
+{
+    sundown_blockmap_rec *map;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(sundown_blockmaps.mutex);
+#endif
+
+    map = apr_hash_get(sundown_blockmaps.table, filename, APR_HASH_KEY_STRING);
+    if (map && strcmp(map->options, options) != 0) {
+        map = NULL;
+    }
+
+    if (map) {
+        map->refcount++;
+        map->used = r->request_time;
+        apr_pool_cleanup_register(r->pool, map, blockmap_release,
+                                  apr_pool_cleanup_null);
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(sundown_blockmaps.mutex);
+#endif
+
+    return map;
+}
+
+/* keeps the blocks of a page: the copies are made without the mutex,
+ * which is only held to create the pool and to swap the map in */
+static void
+blockmap_set(request_rec *r, const char *filename, const char *options,
+             const struct sd_document *document,
+             apr_array_header_t *blocks, struct buf *ob,
+             const struct sdhtml_toc *entries)
+{
+    apr_pool_t *pool;
+    sundown_blockmap_rec *map, *old;
+    apr_hash_index_t *hi;
+    apr_status_t rv;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(sundown_blockmaps.mutex);
+#endif
+    rv = apr_pool_create(&pool, sundown_blockmaps.pool);
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(sundown_blockmaps.mutex);
+#endif
+    if (rv != APR_SUCCESS) {
+        return;
+    }
+
+    map = apr_pcalloc(pool, sizeof(sundown_blockmap_rec));
+    map->pool = pool;
+    map->filename = apr_pstrdup(pool, filename);
+    map->options = apr_pstrdup(pool, options);
+    map->refs = sd_document_refs_hash(document);
+    map->length = sd_document_length(document);
+    map->blocks = apr_pmemdup(pool, blocks->elts,
+                              blocks->nelts * sizeof(sundown_block_rec));
+    map->nblocks = blocks->nelts;
+    map->html = apr_pmemdup(pool, ob->data, ob->size);
+    if (entries) {
+        map->entries = sdhtml_toc_new(bufnew(SUNDOWN_OUTPUT_UNIT));
+        if (map->entries) {
+            apr_pool_cleanup_register(pool, map->entries,
+                                      blockmap_entries_free,
+                                      apr_pool_cleanup_null);
+            sdhtml_toc_append(map->entries, entries, 0, entries->size);
+        }
+    }
+    map->used = r->request_time;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(sundown_blockmaps.mutex);
+#endif
+
+    if (entries && (!map->entries || map->entries->error != BUF_OK)) {
+        apr_pool_destroy(pool);
+    } else {
+        old = apr_hash_get(sundown_blockmaps.table, filename,
+                           APR_HASH_KEY_STRING);
+        if (old) {
+            blockmap_remove(old);
+        } else if (apr_hash_count(sundown_blockmaps.table) >=
+                   (unsigned int)sundown_blockmaps.max) {
+            /* the least recently used page makes room */
+            for (hi = apr_hash_first(NULL, sundown_blockmaps.table); hi;
+                 hi = apr_hash_next(hi)) {
+                sundown_blockmap_rec *entry;
+
+                apr_hash_this(hi, NULL, NULL, (void **)&entry);
+                if (!old || entry->used < old->used) {
+                    old = entry;
+                }
+            }
+            if (old) {
+                blockmap_remove(old);
+            }
+        }
+
+        apr_hash_set(sundown_blockmaps.table, map->filename,
+                     APR_HASH_KEY_STRING, map);
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(sundown_blockmaps.mutex);
+#endif
+}
+
+/* index of the block of the map starting at `begin` and followed by the
+ * same text as the page from `begin + delta`, -1 if none; the blocks
+ * before *checked are known not to be */
+static int
+blockmap_sync(const sundown_blockmap_rec *map,
+              const struct sd_document *document,
+              apr_size_t begin, apr_off_t delta, int *checked)
+{
+    int lo = *checked, hi = map->nblocks, i;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (map->blocks[mid].begin < begin) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo == map->nblocks || map->blocks[lo].begin != begin) {
+        *checked = lo;
+        return -1;
+    }
+
+    for (i = lo; i < map->nblocks; i++) {
+        const sundown_block_rec *block = &map->blocks[i];
+
+        if (sd_document_hash(document, block->begin + delta,
+                             block->end + delta) != block->hash) {
+            *checked = i + 1;
+            return -1;
+        }
+    }
+
+    return lo;
+}
+
+static void
+sundown_block_reuse(sundown_parser_rec *parser, struct buf *ob,
+                    apr_array_header_t *blocks,
+                    const sundown_blockmap_rec *map,
+                    const sundown_block_rec *old, apr_off_t delta)
+{
+    struct sdhtml_toc *entries = parser->options.toc_data.entries;
+    sundown_block_rec *block = apr_array_push(blocks);
+
+    *block = *old;
+    block->begin += delta;
+    block->end += delta;
+    block->reach += delta;
+    block->base = parser->options.toc_data.header_count;
+    block->first = ob->size == 0;
+
+    block->html = ob->size;
+    bufput(ob, map->html + old->html, old->html_size);
+    if (entries) {
+        block->entries = entries->size;
+        sdhtml_toc_append(entries, map->entries, old->entries,
+                          old->nentries);
+    }
+
+    parser->options.toc_data.header_count += old->headers;
+}
+
+static int
+sundown_block_render(sundown_parser_rec *parser, struct buf *ob,
+                     apr_array_header_t *blocks,
+                     const struct sd_document *document, apr_size_t begin)
+{
+    struct sdhtml_toc *entries = parser->options.toc_data.entries;
+    sundown_block_rec *block = apr_array_push(blocks);
+    size_t next = begin, reach = begin;
+    int err;
+
+    block->begin = begin;
+    block->base = parser->options.toc_data.header_count;
+    block->first = ob->size == 0;
+    block->html = ob->size;
+    block->entries = entries ? entries->size : 0;
+
+    err = sd_markdown_render_block(ob, document, parser->markdown, begin,
+                                   &next, &reach);
+
+    block->end = next;
+    block->reach = reach;
+    block->hash = sd_document_hash(document, begin, next);
+    block->headers = parser->options.toc_data.header_count - block->base;
+    block->html_size = ob->size - block->html;
+    block->nentries = entries ? entries->size - block->entries : 0;
+
+    return err;
+}
+
+/* renders a page block by block, reusing the output of the blocks of its
+ * last render whose text did not change: the blocks before an edit that
+ * did not read as far as it, and after it the blocks following the first
+ * rendered block that ends where one of the map starts, with the same
+ * text after it. Any change of the references renders every block */
+static int
+sundown_render_blocks(request_rec *r, sundown_parser_rec *parser,
+                      const char *key, const struct sd_document *document,
+                      struct buf *ob)
+{
+    apr_size_t length = sd_document_length(document);
+    const char *options = key;
+    char *filename;
+    sundown_blockmap_rec *map;
+    apr_array_header_t *blocks;
+    apr_off_t delta = 0;
+    apr_size_t pos = 0;
+    int i, checked = 0, reused = 0, err = BUF_OK;
+
+    /* the page key: file name, mtime, size and the render options */
+    for (i = 0; i < 3 && options; i++) {
+        options = strchr(options, '\n');
+        if (options) {
+            options++;
+        }
+    }
+    if (!options) {
+        return sd_markdown_render_document(ob, document, parser->markdown);
+    }
+    filename = apr_pstrndup(r->pool, key, strcspn(key, "\n"));
+
+    map = blockmap_get(r, filename, options);
+    if (map && map->refs != sd_document_refs_hash(document)) {
+        map = NULL;
+    }
+    if (map) {
+        delta = (apr_off_t)length - (apr_off_t)map->length;
+    }
+
+    blocks = apr_array_make(r->pool, map ? map->nblocks : 64,
+                            sizeof(sundown_block_rec));
+
+    /* blocks before the edit, read up to where it starts at most */
+    if (map) {
+        apr_size_t changed = map->length;
+
+        for (i = 0; i < map->nblocks; i++) {
+            const sundown_block_rec *block = &map->blocks[i];
+
+            if (block->end > length ||
+                sd_document_hash(document, block->begin,
+                                 block->end) != block->hash) {
+                changed = block->begin;
+                break;
+            }
+        }
+
+        for (i = 0; i < map->nblocks; i++) {
+            const sundown_block_rec *block = &map->blocks[i];
+
+            if (block->end > changed || block->reach > changed ||
+                (block->reach == map->length && length != map->length)) {
+                break;
+            }
+
+            sundown_block_reuse(parser, ob, blocks, map, block, 0);
+            pos = block->end;
+            reused++;
+        }
+    }
+
+    while (err == BUF_OK && pos < length) {
+        /* once in step with the map, the rest of the page is the same */
+        i = -1;
+        if (map && (apr_off_t)pos >= delta) {
+            i = blockmap_sync(map, document, (apr_size_t)(pos - delta),
+                              delta, &checked);
+        }
+
+        for (; i >= 0 && i < map->nblocks && err == BUF_OK; i++) {
+            const sundown_block_rec *block = &map->blocks[i];
+
+            /* header ids and separators depend on the blocks before */
+            if ((block->headers &&
+                 block->base != parser->options.toc_data.header_count) ||
+                block->first != (ob->size == 0)) {
+                err = sundown_block_render(parser, ob, blocks, document, pos);
+            } else {
+                sundown_block_reuse(parser, ob, blocks, map, block, delta);
+                reused++;
+            }
+            pos = block->end + delta;
+        }
+        if (i >= 0) {
+            break;
+        }
+
+        err = sundown_block_render(parser, ob, blocks, document, pos);
+        pos = APR_ARRAY_IDX(blocks, blocks->nelts - 1, sundown_block_rec).end;
+    }
+
+    _RDEBUG(r, "blocks: %d of %d reused", reused, blocks->nelts);
+
+    if (err == BUF_OK) {
+        err = ob->error;
+    }
+
+    /* every block of the map reused in place: it is the same map */
+    if (err == BUF_OK &&
+        !(map && delta == 0 && reused == map->nblocks &&
+          blocks->nelts == map->nblocks)) {
+        blockmap_set(r, filename, options, document, blocks, ob,
+                     parser->options.toc_data.entries);
+    }
+
+    return err;
+}
+
+static apr_status_t
+remote_release(void *data)
+{
+    sundown_remote_rec *remote = (sundown_remote_rec *)data;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(sundown_remotes.mutex);
+#endif
+
+    if (--remote->refcount == 0 && remote->stale) {
+        apr_pool_destroy(remote->pool);
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(sundown_remotes.mutex);
+#endif
+
+    return APR_SUCCESS;
+}
+
+/* takes a document out of the table; called with the mutex held */
+static void
+remote_remove(sundown_remote_rec *remote)
+{
+    apr_hash_set(sundown_remotes.table, remote->url, APR_HASH_KEY_STRING,
+                 NULL);
+    remote->stale = 1;
+    if (remote->refcount == 0) {
+        apr_pool_destroy(remote->pool);
+    }
+}
+
+/* the kept document at url and whether it is still fresh */
+static sundown_remote_rec *
+remote_get(request_rec *r, const char *url, int *fresh)
+{
+    sundown_remote_rec *remote;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(sundown_remotes.mutex);
+#endif
+
+    remote = apr_hash_get(sundown_remotes.table, url, APR_HASH_KEY_STRING);
+    if (remote) {
+        remote->refcount++;
+        remote->used = r->request_time;
+        *fresh = r->request_time - remote->fetched < sundown_remotes.ttl;
+        apr_pool_cleanup_register(r->pool, remote, remote_release,
+                                  apr_pool_cleanup_null);
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(sundown_remotes.mutex);
+#endif
+
+    return remote;
+}
+
+/* the document did not change upstream: fresh for another ttl */
+static void
+remote_touch(request_rec *r, sundown_remote_rec *remote)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(sundown_remotes.mutex);
+#endif
+
+    if (!remote->stale) {
+        remote->fetched = r->request_time;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(sundown_remotes.mutex);
+#endif
+}
+
+static void
+remote_set(request_rec *r, const char *url, const char *data,
+           apr_size_t size, sundown_fetch_rec *fetch)
+{
+    apr_pool_t *pool;
+    sundown_remote_rec *remote, *old;
+    apr_hash_index_t *hi;
+    apr_status_t rv;
+
+    /* the copy is made without the mutex, held only to create the pool
+     * and to swap the document in */
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(sundown_remotes.mutex);
+#endif
+    rv = apr_pool_create(&pool, sundown_remotes.pool);
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(sundown_remotes.mutex);
+#endif
+    if (rv != APR_SUCCESS) {
+        return;
+    }
+
+    remote = apr_pcalloc(pool, sizeof(sundown_remote_rec));
+    remote->pool = pool;
+    remote->url = apr_pstrdup(pool, url);
+    remote->data = apr_pmemdup(pool, data, size);
+    remote->size = size;
+    if (fetch->etag) {
+        remote->etag = apr_pstrdup(pool, fetch->etag);
+    }
+    if (fetch->last_modified) {
+        remote->last_modified = apr_pstrdup(pool, fetch->last_modified);
+    }
+    remote->fetched = r->request_time;
+    remote->used = r->request_time;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(sundown_remotes.mutex);
+#endif
+
+    old = apr_hash_get(sundown_remotes.table, url, APR_HASH_KEY_STRING);
+    if (old) {
+        remote_remove(old);
+    } else if (apr_hash_count(sundown_remotes.table) >=
+               (unsigned int)sundown_remotes.max) {
+        /* the least recently used document makes room */
+        for (hi = apr_hash_first(NULL, sundown_remotes.table); hi;
+             hi = apr_hash_next(hi)) {
+            sundown_remote_rec *entry;
+
+            apr_hash_this(hi, NULL, NULL, (void **)&entry);
+            if (!old || entry->used < old->used) {
+                old = entry;
+            }
+        }
+        if (old) {
+            remote_remove(old);
+        }
+    }
+
+    apr_hash_set(sundown_remotes.table, remote->url, APR_HASH_KEY_STRING,
+                 remote);
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(sundown_remotes.mutex);
+#endif
+}
+
+#if APR_HAS_THREADS
+static void
+remote_lock(CURL *curl, curl_lock_data data, curl_lock_access access,
+            void *user)
+{
+    if (data >= 0 && data < CURL_LOCK_DATA_LAST &&
+        sundown_remotes.locks[data]) {
+        apr_thread_mutex_lock(sundown_remotes.locks[data]);
+    }
+}
+
+static void
+remote_unlock(CURL *curl, curl_lock_data data, void *user)
+{
+    if (data >= 0 && data < CURL_LOCK_DATA_LAST &&
+        sundown_remotes.locks[data]) {
+        apr_thread_mutex_unlock(sundown_remotes.locks[data]);
+    }
+}
+#endif
+
+/* an idle handle keeps its connections open for the next fetch */
+static CURL *
+remote_handle_get(void)
+{
+    CURL *curl = NULL;
+
+    if (sundown_remotes.handles) {
+#if APR_HAS_THREADS
+        apr_thread_mutex_lock(sundown_remotes.mutex);
+#endif
+        if (sundown_remotes.handles->nelts > 0) {
+            curl = *(CURL **)apr_array_pop(sundown_remotes.handles);
+        }
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock(sundown_remotes.mutex);
+#endif
+    }
+
+    if (!curl) {
+        curl = curl_easy_init();
+    }
+
+    return curl;
+}
+
+static void
+remote_handle_put(CURL *curl)
+{
+    if (!sundown_remotes.handles) {
+        curl_easy_cleanup(curl);
+        return;
+    }
+
+    /* options are set again for each fetch */
+    curl_easy_reset(curl);
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(sundown_remotes.mutex);
+#endif
+    *(CURL **)apr_array_push(sundown_remotes.handles) = curl;
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(sundown_remotes.mutex);
+#endif
+}
+
+static apr_status_t
+remote_cleanup(void *data)
+{
+    int i;
+
+    if (sundown_remotes.handles) {
+        for (i = 0; i < sundown_remotes.handles->nelts; i++) {
+            curl_easy_cleanup(APR_ARRAY_IDX(sundown_remotes.handles, i,
+                                            CURL *));
+        }
+        sundown_remotes.handles = NULL;
+    }
+    if (sundown_remotes.share) {
+        curl_share_cleanup(sundown_remotes.share);
+        sundown_remotes.share = NULL;
+    }
+    sundown_remotes.table = NULL;
+
+    curl_global_cleanup();
+
+    return APR_SUCCESS;
+}
+
+/* validators of the response, from the headers of its last hop */
+static size_t
+remote_header(char *buffer, size_t size, size_t nitems, void *user)
+{
+    sundown_fetch_rec *fetch = (sundown_fetch_rec *)user;
+    size_t len = size * nitems;
+    char *line, *value;
+
+    if (len >= 5 && strncasecmp(buffer, "HTTP/", 5) == 0) {
+        fetch->length = -1;
+        fetch->etag = NULL;
+        fetch->last_modified = NULL;
+        fetch->no_store = 0;
+        return len;
+    }
+
+    line = apr_pstrndup(fetch->pool, buffer, len);
+    value = strchr(line, ':');
+    if (!value) {
+        return len;
+    }
+    *value++ = '\0';
+    while (apr_isspace(*value)) {
+        value++;
+    }
+    value[strcspn(value, "\r\n")] = '\0';
+
+    if (strcasecmp(line, "Content-Length") == 0) {
+        char *end;
+
+        if (apr_strtoff(&fetch->length, value, &end, 10) != APR_SUCCESS ||
+            *end) {
+            fetch->length = -1;
+        }
+    } else if (strcasecmp(line, "ETag") == 0) {
+        fetch->etag = value;
+    } else if (strcasecmp(line, "Last-Modified") == 0) {
+        fetch->last_modified = value;
+    } else if (strcasecmp(line, "Cache-Control") == 0 &&
+               ap_strcasestr(value, "no-store")) {
+        fetch->no_store = 1;
+    }
+
+    return len;
+}
+
+static int
+remote_size_error(request_rec *r, const char *url)
+{
+    SUNDOWN_STATS_INC(input_limit);
+    _RINFO(r, "url size exceeded: %s", url);
+    return HTTP_REQUEST_ENTITY_TOO_LARGE;
+}
+
+/* counts a fetch against the fetches at once of all children: 1 when
+ * counted, 0 when there is no limit, -1 when it is reached */
+static int
+remote_fetch_enter(void)
+{
+    if (sundown_remotes.max_fetches <= 0 || !sundown_stats) {
+        return 0;
+    }
+
+    if (apr_atomic_inc32(&sundown_stats->remote_fetches) >=
+        (apr_uint32_t)sundown_remotes.max_fetches) {
+        apr_atomic_dec32(&sundown_stats->remote_fetches);
+        SUNDOWN_STATS_INC(remote_limit);
+        return -1;
+    }
+
+    return 1;
+}
+
+static void
+remote_fetch_leave(int counted)
+{
+    if (counted > 0) {
+        apr_atomic_dec32(&sundown_stats->remote_fetches);
+    }
+}
+
+/* the kept copy stands in for a fetch that could not be waited for,
+ * otherwise 503 */
+static int
+remote_fallback(request_rec *r, struct buf *ib, const char *url,
+                sundown_remote_rec *remote, apr_off_t max_size,
+                const char *reason)
+{
+    if (!remote) {
+        _RINFO(r, "%s: %s", reason, url);
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    _RDEBUG(r, "url: %s: %s, kept copy", url, reason);
+    if (max_size > 0 && (apr_off_t)remote->size > max_size) {
+        return remote_size_error(r, url);
+    }
+    append_data(ib, remote->data, remote->size);
+
+    return OK;
+}
+
+/* fetches the document at url into ib, revalidating the kept copy with
+ * its etag or date when upstream gave one; a document larger than
+ * max_size is not read further */
+static int
+remote_fetch(request_rec *r, struct buf *ib, const char *url,
+             sundown_remote_rec *remote, apr_off_t max_size)
+{
+    sundown_fetch_rec fetch;
+    struct curl_slist *headers = NULL;
+    apr_size_t start = ib->size;
+    apr_time_t begin = apr_time_now();
+    long status = 0;
+    int counted;
+    CURL *curl;
+    CURLcode ret;
+
+    /* fetches of all children at once */
+    counted = remote_fetch_enter();
+    if (counted < 0) {
+        return remote_fallback(r, ib, url, remote, max_size,
+                               "too many url fetches");
+    }
+
+    curl = remote_handle_get();
+    if (!curl) {
+        remote_fetch_leave(counted);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    memset(&fetch, 0, sizeof(sundown_fetch_rec));
+    fetch.pool = r->pool;
+    fetch.ib = ib;
+    fetch.start = start;
+    fetch.length = -1;
+    fetch.max_size = max_size;
+
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+
+    /* curl */
+    if (sundown_remotes.share) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, sundown_remotes.share);
+    }
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&fetch);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, append_url_data);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)&fetch);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, remote_header);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, SUNDOWN_CURL_TIMEOUT);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, SUNDOWN_FETCH_TIMEOUT);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1);
+    if (max_size > 0) {
+        curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE,
+                         (curl_off_t)max_size);
+    }
+
+    if (remote && remote->etag) {
+        headers = curl_slist_append(headers,
+                                    apr_pstrcat(r->pool, "If-None-Match: ",
+                                                remote->etag, NULL));
+    }
+    if (remote && remote->last_modified) {
+        headers = curl_slist_append(headers,
+                                    apr_pstrcat(r->pool, "If-Modified-Since: ",
+                                                remote->last_modified, NULL));
+    }
+    if (headers) {
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    }
+
+    ret = curl_easy_perform(curl);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+
+    remote_fetch_leave(counted);
+
+    remote_handle_put(curl);
+    if (headers) {
+        curl_slist_free_all(headers);
+    }
+
+    /* the fetch, apart from the render */
+    apr_table_setn(r->notes, "sundown_fetch_time",
+                   apr_psprintf(r->pool, "%" APR_TIME_T_FMT,
+                                apr_time_now() - begin));
+    apr_table_setn(r->notes, "sundown_fetch_bytes",
+                   apr_psprintf(r->pool, "%" APR_SIZE_T_FMT,
+                                ib->size - start));
+    _RDEBUG(r, "url: %s: %ld, %" APR_SIZE_T_FMT " bytes in %" APR_TIME_T_FMT
+            "us", url, status, ib->size - start, apr_time_now() - begin);
+
+    if (fetch.too_large || ret == CURLE_FILESIZE_EXCEEDED) {
+        ib->size = start;
+        return remote_size_error(r, url);
+    }
+
+    if (remote && (ret != CURLE_OK || status == HTTP_NOT_MODIFIED)) {
+        /* unchanged, or upstream is unreachable: the copy stands in */
+        if (ret == CURLE_OK) {
+            remote_touch(r, remote);
+        } else {
+            _RDEBUG(r, "url: %s: %s", url, curl_easy_strerror(ret));
+        }
+        ib->size = start;
+        if (max_size > 0 && (apr_off_t)remote->size > max_size) {
+            return remote_size_error(r, url);
+        }
+        append_data(ib, remote->data, remote->size);
+        return OK;
+    }
+
+    if (sundown_remotes.table && ret == CURLE_OK && status == HTTP_OK &&
+        ib->error == BUF_OK && !fetch.no_store) {
+        remote_set(r, url, (const char *)ib->data + start, ib->size - start,
+                   &fetch);
+    }
+
+    return OK;
+}
+
+#if APR_HAS_THREADS
+/* the fetch of url in progress, joined when there is one; *leader is set
+ * when the caller is to fetch it, with no flight when none could be made,
+ * otherwise it has been fetched. A wait lasts as long as a fetch may: NULL
+ * without *leader when it timed out */
+static sundown_flight_rec *
+flight_join(const char *url, int *leader)
+{
+    sundown_flight_rec *flight;
+    apr_pool_t *pool;
+    apr_time_t until, now;
+
+    apr_thread_mutex_lock(sundown_remotes.mutex);
+
+    *leader = 1;
+    flight = apr_hash_get(sundown_remotes.flights, url, APR_HASH_KEY_STRING);
+    if (flight) {
+        *leader = 0;
+        until = apr_time_now() + apr_time_from_sec(SUNDOWN_FETCH_TIMEOUT);
+        flight->refcount++;
+        while (!flight->done && (now = apr_time_now()) < until) {
+            apr_thread_cond_timedwait(flight->cond, sundown_remotes.mutex,
+                                      until - now);
+        }
+        if (!flight->done) {
+            if (--flight->refcount == 0) {
+                apr_pool_destroy(flight->pool);
+            }
+            flight = NULL;
+        }
+    } else if (apr_pool_create(&pool, sundown_remotes.pool) == APR_SUCCESS) {
+        flight = apr_pcalloc(pool, sizeof(sundown_flight_rec));
+        flight->pool = pool;
+        flight->url = apr_pstrdup(pool, url);
+        flight->refcount = 1;
+        if (apr_thread_cond_create(&flight->cond, pool) == APR_SUCCESS) {
+            apr_hash_set(sundown_remotes.flights, flight->url,
+                         APR_HASH_KEY_STRING, flight);
+            *leader = 1;
+        } else {
+            apr_pool_destroy(pool);
+            flight = NULL;
+        }
+    }
+
+    apr_thread_mutex_unlock(sundown_remotes.mutex);
+
+    return flight;
+}
+
+static void
+flight_leave(sundown_flight_rec *flight)
+{
+    apr_thread_mutex_lock(sundown_remotes.mutex);
+
+    if (--flight->refcount == 0) {
+        apr_pool_destroy(flight->pool);
+    }
+
+    apr_thread_mutex_unlock(sundown_remotes.mutex);
+}
+
+/* hands the result to the requests waiting for it */
+static void
+flight_done(sundown_flight_rec *flight, const struct buf *ib,
+            apr_size_t start, int ret, apr_off_t max_size)
+{
+    int waiters;
+
+    /* no one joins once it is out of the table */
+    apr_thread_mutex_lock(sundown_remotes.mutex);
+    apr_hash_set(sundown_remotes.flights, flight->url, APR_HASH_KEY_STRING,
+                 NULL);
+    waiters = flight->refcount - 1;
+    apr_thread_mutex_unlock(sundown_remotes.mutex);
+
+    flight->ret = ret;
+    flight->error = ib->error;
+    flight->max_size = max_size;
+    if (waiters > 0 && ret == OK) {
+        flight->size = ib->size - start;
+        flight->data = apr_pmemdup(flight->pool, ib->data + start,
+                                   flight->size);
+    }
+
+    apr_thread_mutex_lock(sundown_remotes.mutex);
+    flight->done = 1;
+    apr_thread_cond_broadcast(flight->cond);
+    apr_thread_mutex_unlock(sundown_remotes.mutex);
+
+    flight_leave(flight);
+}
+#endif
+
+/* appends the document at url to ib; a kept copy is used while fresh and
+ * requests for a url being fetched wait for that fetch */
+static int
+sundown_fetch_url(request_rec *r, struct buf *ib, const char *url,
+                  apr_off_t max_size)
+{
+    sundown_remote_rec *remote = NULL;
+    int fresh = 0, ret;
+#if APR_HAS_THREADS
+    sundown_flight_rec *flight = NULL;
+    apr_size_t start = ib->size;
+    int leader = 1;
+#endif
+
+    if (sundown_remotes.table) {
+        remote = remote_get(r, url, &fresh);
+    }
+    if (remote && fresh) {
+        _RDEBUG(r, "url: %s cached", url);
+        if (max_size > 0 && (apr_off_t)remote->size > max_size) {
+            return remote_size_error(r, url);
+        }
+        append_data(ib, remote->data, remote->size);
+        return OK;
+    }
+
+#if APR_HAS_THREADS
+    if (sundown_remotes.flights) {
+        flight = flight_join(url, &leader);
+    }
+    if (!leader && !flight) {
+        return remote_fallback(r, ib, url, remote, max_size,
+                               "url fetch of another request timed out");
+    }
+    if (!leader) {
+        /* the whole document, checked against the limit of this request */
+        ret = flight->ret;
+        if (ret == OK && flight->error == BUF_OK) {
+            _RDEBUG(r, "url: %s fetched by another request", url);
+            if (max_size > 0 && (apr_off_t)flight->size > max_size) {
+                ret = remote_size_error(r, url);
+            } else {
+                append_data(ib, (void *)flight->data, flight->size);
+            }
+            flight_leave(flight);
+            return ret;
+        }
+
+        /* stopped by the limits of the other request, fetched again here
+         * unless ours is no larger */
+        if (ret == HTTP_REQUEST_ENTITY_TOO_LARGE && max_size > 0 &&
+            max_size <= flight->max_size) {
+            ret = remote_size_error(r, url);
+        } else if (ret == HTTP_REQUEST_ENTITY_TOO_LARGE || ret == OK) {
+            ret = -1;
+        }
+        flight_leave(flight);
+        if (ret != -1) {
+            return ret;
+        }
+        _RDEBUG(r, "url: %s over the limits of another request", url);
+        flight = NULL;
+    }
+#endif
+
+    ret = remote_fetch(r, ib, url, remote, max_size);
+
+#if APR_HAS_THREADS
+    if (flight) {
+        flight_done(flight, ib, start, ret, max_size);
+    }
+#endif
+
+    return ret;
+}
+
 /* content handler */
 static int
 sundown_handler(request_rec *r)
 {
     int ret = -1;
     int directory = 1;
-    apr_file_t *fp = NULL;
+    sundown_style_rec *layout = NULL;
     char *url = NULL;
     char *style = NULL;
     char *text = NULL;
     char *raw = NULL;
     char *toc = NULL;
+    char *key = NULL;
+    int err = BUF_OK;
+    sundown_stream_rec *stream = NULL;
+    apr_finfo_t finfo;
     apreq_handle_t *apreq;
     apr_table_t *params;
 
     sundown_config_rec *cfg;
 
     /* sundown: markdown */
-    struct buf *ib, *ob;
-    struct sd_callbacks callbacks;
-    struct html_renderopt options;
-    struct sd_markdown *markdown;
+    struct buf *ib = NULL, *ob, *toc_ob = NULL;
+    struct sdhtml_toc *entries = NULL;
+    int toc_begin = 2, toc_end = 0;
+    struct buf page = { NULL, 0, 0, 0 };
+    sundown_parser_rec *parser;
+    struct sd_document *document;
     unsigned int markdown_extensions = 0;
+    apr_time_t render_begin;
 
     if (strcmp(r->handler, "sundown")) {
         return DECLINED;
     }
 
-    if (r->header_only) {
-        return OK;
-    }
-
     /* config */
     cfg = ap_get_module_config(r->per_dir_config, &sundown_module);
 
@@ -339,56 +2721,108 @@ sundown_handler(request_rec *r)
         }
     }
 
-    /* reading everything */
-    ib = bufnew(SUNDOWN_READ_UNIT);
-    bufgrow(ib, SUNDOWN_READ_UNIT);
-
     /* page */
     if (url || text) {
         directory = 0;
     }
-    append_page_data(r, cfg, ib, r->filename, directory);
 
-    /* text */
-    if (text && strlen(text) > 0) {
-        append_data(ib, text, strlen(text));
+    /* a posted document larger than allowed is refused before any work */
+    if (cfg->max_input_size > 0 && text &&
+        (apr_off_t)strlen(text) > cfg->max_input_size) {
+        return sundown_input_error(r);
     }
 
-    /* url */
-    if (url && strlen(url) > 0) {
-        CURL *curl;
+#ifdef SUNDOWN_RAW_SUPPORT
+    /* raw page: the file itself, without reading it here */
+    if (raw != NULL && (!url || strlen(url) == 0) &&
+        (!text || strlen(text) == 0)) {
+        return sundown_raw_page(r, cfg, directory);
+    }
+#endif
 
-        curl = curl_easy_init();
-        if (!curl) {
-            return HTTP_INTERNAL_SERVER_ERROR;
+    /* validators: local files only */
+    if ((!url || strlen(url) == 0) && (!text || strlen(text) == 0)
+#ifdef SUNDOWN_RAW_SUPPORT
+        && raw == NULL
+#endif
+        ) {
+        key = sundown_page_key(r, cfg, directory, toc, &finfo);
+        if (key) {
+            layout = style_lookup(r, cfg, style);
+            ret = sundown_validators(r, key, &finfo, layout);
+            if (ret != OK) {
+                return ret;
+            }
+        }
+    }
+
+    /* cached output; HEAD is answered from it too, with its length */
+    if (key) {
+        char *data = NULL;
+        apr_size_t size = 0;
+
+        if (sundown_cache_get(r, key, &data, &size)) {
+            style_page(r, layout, NULL, data, size);
+            return OK;
+        }
+    }
+
+    /* page only: mapped without copying */
+    if ((!url || strlen(url) == 0) && (!text || strlen(text) == 0)) {
+        ret = map_page_data(r, cfg, &page, r->filename, directory);
+        if (ret == APR_ENOENT) {
+            ret = map_page_data(r, cfg, &page, NULL, 0);
         }
+        if (ret == APR_SUCCESS) {
+            ib = &page;
+        }
+    }
 
-        curl_easy_setopt(curl, CURLOPT_URL, url);
+    /* reading everything */
+    if (!ib) {
+        apr_size_t size = SUNDOWN_READ_UNIT;
 
-        /* curl */
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)ib);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, append_url_data);
-        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
-        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, SUNDOWN_CURL_TIMEOUT);
-        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
+        if (r->finfo.filetype == APR_REG && r->finfo.size > 0) {
+            size += r->finfo.size;
+        }
+        if (text) {
+            size += strlen(text);
+        }
 
-        ret = curl_easy_perform(curl);
+        ib = sundown_bufnew(r, SUNDOWN_READ_UNIT, cfg->max_buffer_size);
+        bufreserve(ib, size);
 
-        curl_easy_cleanup(curl);
+        append_page_data(r, cfg, ib, r->filename, directory);
+    }
 
-        /*
-        if (ret != 0) {
-            bufrelease(ib);
-            return HTTP_INTERNAL_SERVER_ERROR;
+    /* text */
+    if (text && strlen(text) > 0) {
+        append_data(ib, text, strlen(text));
+    }
+
+    /* url */
+    if (url && strlen(url) > 0) {
+        ret = sundown_fetch_url(r, ib, url, cfg->max_remote_size);
+        if (ret != OK) {
+            return ret;
         }
-        */
+    }
+
+    if (ib->error != BUF_OK) {
+        return sundown_buffer_error(r, ib->error);
+    }
+
+    if (cfg->max_input_size > 0 && (apr_off_t)ib->size > cfg->max_input_size) {
+        return sundown_input_error(r);
     }
 
     /* default page */
     if (ib->size == 0) {
         ret = append_page_data(r, cfg, ib, NULL, 0);
+        if (ret == APR_SUCCESS && ib->error != BUF_OK) {
+            ret = sundown_buffer_error(r, ib->error);
+        }
         if (ret != APR_SUCCESS) {
-            bufrelease(ib);
             return ret;
         }
     }
@@ -397,44 +2831,14 @@ sundown_handler(request_rec *r)
 #ifdef SUNDOWN_RAW_SUPPORT
         if (raw != NULL) {
             r->content_type = "text/plain";
+            ap_set_content_length(r, ib->size);
             ap_rwrite(ib->data, ib->size, r);
-            bufrelease(ib);
             return OK;
         }
 #endif
 
-        /* output style header */
-        fp = style_header(r, cfg, style);
-
         /* markdown extensions */
-        markdown_extensions = 0;
-#ifdef SUNDOWN_USE_FENCED_CODE
-        markdown_extensions |= MKDEXT_FENCED_CODE;
-#endif
-#ifdef SUNDOWN_USE_NO_INTRA_EMPHASIS
-        markdown_extensions |= MKDEXT_NO_INTRA_EMPHASIS;
-#endif
-#ifdef SUNDOWN_USE_AUTOLINK
-        markdown_extensions |= MKDEXT_AUTOLINK;
-#endif
-#ifdef SUNDOWN_USE_STRIKETHROUGH
-        markdown_extensions |= MKDEXT_STRIKETHROUGH;
-#endif
-#ifdef SUNDOWN_USE_LAX_HTML_BLOCKS
-        markdown_extensions |= MKDEXT_LAX_HTML_BLOCKS;
-#endif
-#ifdef SUNDOWN_USE_SPACE_HEADERS
-        markdown_extensions |= MKDEXT_SPACE_HEADERS;
-#endif
-#ifdef SUNDOWN_USE_SUPERSCRIPT
-        markdown_extensions |= MKDEXT_SUPERSCRIPT;
-#endif
-#ifdef SUNDOWN_USE_TABLES
-        markdown_extensions |= MKDEXT_TABLES;
-#endif
-#ifdef SUNDOWN_USE_SPECIAL_ATTRIBUTES
-        markdown_extensions |= MKDEXT_SPECIAL_ATTRIBUTES;
-#endif
+        markdown_extensions = sundown_extensions();
 
 #if defined(SUNDOWN_TOC_SUPPORT) || defined(SUNDOWN_USE_TOC)
         /* toc */
@@ -471,79 +2875,171 @@ sundown_handler(request_rec *r)
                 }
             }
 
-            ob = bufnew(SUNDOWN_OUTPUT_UNIT);
-
-            sdhtml_toc_renderer(&callbacks, &options);
-
-            options.toc_data.begin_level = begin;
-            if (end) {
-                options.toc_data.end_level = end;
-            }
-            options.toc_data.class = "toc";
-
-            markdown = sd_markdown_new(markdown_extensions, 16,
-                                       &callbacks, &options);
-
-            sd_markdown_render(ob, ib->data, ib->size, markdown);
-            sd_markdown_free(markdown);
-
-            ap_rwrite(ob->data, ob->size, r);
+            toc_begin = begin;
+            toc_end = end;
 
-            bufrelease(ob);
+            /* headers are collected while the body is rendered */
+            toc_ob = sundown_bufnew(r, SUNDOWN_OUTPUT_UNIT,
+                                    cfg->max_buffer_size);
+            entries = sdhtml_toc_new(sundown_bufnew(r, SUNDOWN_OUTPUT_UNIT,
+                                                    cfg->max_buffer_size));
         }
 #endif
 
         /* performing markdown parsing */
-        ob = bufnew(SUNDOWN_OUTPUT_UNIT);
+        ob = sundown_bufnew(r, SUNDOWN_OUTPUT_UNIT, cfg->max_buffer_size);
 
         /* markdown render */
-        sdhtml_renderer(&callbacks, &options, 0);
+        parser = sundown_parser_get(r, SUNDOWN_PARSER_HTML,
+                                    markdown_extensions,
+                                    sundown_render_flags(),
+                                    cfg->max_nesting > 0 ?
+                                    cfg->max_nesting : SUNDOWN_MAX_NESTING);
+        if (!parser) {
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
 
-#ifdef SUNDOWN_USE_SKIP_LINEBREAK
-        options.flags |= HTML_SKIP_LINEBREAK;
-#endif
-#ifdef SUNDOWN_USE_XHTML
-        options.flags |= HTML_USE_XHTML;
-#endif
-#ifdef SUNDOWN_TOC_SUPPORT
-        options.flags |= HTML_TOC;
-#endif
 #ifdef SUNDOWN_USE_TASK_LISTS
-        options.flags |= HTML_USE_TASK_LIST;
         if (cfg->class_task) {
-            options.class_attributes.task = cfg->class_task;
+            parser->options.class_attributes.task = cfg->class_task;
         }
 #endif
 
         if (cfg->class_ol) {
-            options.class_attributes.ol = cfg->class_ol;
+            parser->options.class_attributes.ol = cfg->class_ol;
         }
         if (cfg->class_ul) {
-            options.class_attributes.ul = cfg->class_ul;
+            parser->options.class_attributes.ul = cfg->class_ul;
+        }
+
+        if (entries) {
+            parser->options.toc_data.entries = entries;
+            parser->options.toc_data.begin_level = toc_begin;
+            if (toc_end) {
+                parser->options.toc_data.end_level = toc_end;
+            }
+            parser->options.toc_data.class = "toc";
+            sd_markdown_set_header_text(parser->markdown, sdhtml_toc_collect,
+                                        &parser->options);
+        }
+
+        /* render memory: released at once with the request, or work
+         * buffers kept by the parser for the next request */
+        if (cfg->allocator == SUNDOWN_ALLOCATOR_POOL) {
+            sd_markdown_set_render_allocator(parser->markdown,
+                                             sundown_pool_allocator(r));
+        } else if (cfg->allocator != SUNDOWN_ALLOCATOR_MALLOC) {
+            if (!parser->arena) {
+                parser->arena = sd_arena_new(SUNDOWN_ARENA_CHUNK);
+            }
+            sd_markdown_set_arena(parser->markdown, parser->arena);
+        }
+
+        sd_markdown_set_buffer_limit(parser->markdown, cfg->max_buffer_size);
+        if (cfg->max_work > 0) {
+            sd_markdown_set_work_budget(parser->markdown,
+                                        (size_t)cfg->max_work);
+        }
+
+        /* streaming: the toc is only known after the body is rendered,
+         * without chunks (HTTP/1.0) a cut page looks complete, and HEAD
+         * is answered with the length of the whole page */
+        if (!toc_ob && cfg->flush_size > 0 && !r->header_only &&
+            r->proto_num >= HTTP_VERSION(1, 1)) {
+            if (!layout) {
+                layout = style_lookup(r, cfg, style);
+            }
+            style_header(r, layout);
+
+            stream = apr_pcalloc(r->pool, sizeof(sundown_stream_rec));
+            stream->r = r;
+            stream->bb = apr_brigade_create(r->pool,
+                                            r->connection->bucket_alloc);
+            if (key && sundown_cache.base) {
+                stream->capture = sundown_bufnew(r, SUNDOWN_OUTPUT_UNIT, 0);
+                stream->capture_max = sundown_cache.entry_size;
+            }
+
+            sd_markdown_set_flush(parser->markdown, (size_t)cfg->flush_size,
+                                  sundown_stream_flush, stream);
+        }
+
+        render_begin = apr_time_now();
+        document = sundown_parser_document(r, parser, key, ib,
+                                           cfg->max_buffer_size);
+        if (document) {
+            if (stream) {
+                /* flushed in order while it is rendered */
+                err = sd_markdown_render_document(ob, document,
+                                                  parser->markdown);
+            } else if (key && sundown_blockmaps.table &&
+                       sd_document_length(document) >=
+                       sundown_blockmaps.min_size) {
+                err = sundown_render_blocks(r, parser, key, document, ob);
+            } else {
+                err = sundown_render_parallel(r, cfg, parser, document, ob);
+            }
+            if (err != BUF_OK) {
+                sundown_parser_forget(parser);
+            }
+        } else {
+            err = BUF_ENOMEM;
+        }
+        apr_table_setn(r->notes, "sundown_render_time",
+                       apr_psprintf(r->pool, "%" APR_TIME_T_FMT,
+                                    apr_time_now() - render_begin));
+
+        if (entries) {
+            if (err == BUF_OK) {
+                err = entries->error;
+            }
+            if (err == BUF_OK) {
+                sdhtml_toc_entries(toc_ob, &parser->options);
+                err = toc_ob->error;
+            }
+            parser->options.toc_data.entries = NULL;
         }
 
-        markdown = sd_markdown_new(markdown_extensions, 16,
-                                   &callbacks, &options);
+        if (err != BUF_OK) {
+            ret = sundown_buffer_error(r, err);
+            if (stream) {
+                /* part of the page is out: abort the response */
+                sundown_stream_abort(stream, ret);
+                return OK;
+            }
+            /* nothing has been sent yet: fail instead of a truncated page */
+            return ret;
+        }
 
-        sd_markdown_render(ob, ib->data, ib->size, markdown);
-        sd_markdown_free(markdown);
+        if (stream) {
+            /* the rest of the body, then the style footer */
+            ap_rwrite(ob->data, ob->size, r);
+            style_footer(r, layout);
+        } else {
+            /* writing the result with the style layout */
+            if (!layout) {
+                layout = style_lookup(r, cfg, style);
+            }
+            style_page(r, layout, toc_ob, (const char *)ob->data, ob->size);
+        }
 
-        /* writing the result */
-        ap_rwrite(ob->data, ob->size, r);
+        /* store the rendered body */
+        if (key && (!stream || stream->capture)) {
+            struct buf *bufs[3];
 
-        /* cleanup */
-        bufrelease(ob);
+            bufs[0] = toc_ob;
+            bufs[1] = stream ? stream->capture : NULL;
+            bufs[2] = ob;
+            sundown_cache_set(r, key, bufs, 3);
+        }
     } else {
-        /* output style header */
-        fp = style_header(r, cfg, style);
+        /* output style layout */
+        if (!layout) {
+            layout = style_lookup(r, cfg, style);
+        }
+        style_page(r, layout, NULL, NULL, 0);
     }
 
-    /* cleanup */
-    bufrelease(ib);
-
-    /* output style footer */
-    style_footer(r, fp);
-
     return OK;
 }
 
@@ -564,6 +3060,13 @@ sundown_create_dir_config(apr_pool_t *p, char *dir)
     cfg->class_ul = NULL;
     cfg->class_ol = NULL;
     cfg->class_task = NULL;
+    cfg->max_buffer_size = 0;
+    cfg->flush_size = -1;
+    cfg->max_nesting = 0;
+    cfg->max_input_size = -1;
+    cfg->max_remote_size = -1;
+    cfg->max_work = -1;
+    cfg->allocator = -1;
 
     return (void *)cfg;
 }
@@ -623,9 +3126,357 @@ sundown_merge_dir_config(apr_pool_t *p, void *base_conf, void *override_conf)
         cfg->class_task = base->class_task;
     }
 
+    if (override->max_buffer_size) {
+        cfg->max_buffer_size = override->max_buffer_size;
+    } else {
+        cfg->max_buffer_size = base->max_buffer_size;
+    }
+
+    if (override->flush_size >= 0) {
+        cfg->flush_size = override->flush_size;
+    } else {
+        cfg->flush_size = base->flush_size;
+    }
+
+    if (override->max_nesting) {
+        cfg->max_nesting = override->max_nesting;
+    } else {
+        cfg->max_nesting = base->max_nesting;
+    }
+
+    if (override->max_input_size >= 0) {
+        cfg->max_input_size = override->max_input_size;
+    } else {
+        cfg->max_input_size = base->max_input_size;
+    }
+
+    if (override->max_remote_size >= 0) {
+        cfg->max_remote_size = override->max_remote_size;
+    } else {
+        cfg->max_remote_size = base->max_remote_size;
+    }
+
+    if (override->max_work >= 0) {
+        cfg->max_work = override->max_work;
+    } else {
+        cfg->max_work = base->max_work;
+    }
+
+    if (override->allocator >= 0) {
+        cfg->allocator = override->allocator;
+    } else {
+        cfg->allocator = base->allocator;
+    }
+
     return (void *)cfg;
 }
 
+static const char *
+sundown_set_max_buffer_size(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    sundown_config_rec *cfg = (sundown_config_rec *)mconfig;
+    apr_off_t size;
+    char *end;
+
+    if (apr_strtoff(&size, arg, &end, 10) != APR_SUCCESS || *end ||
+        size <= 0) {
+        return "SundownMaxBufferSize must be a positive size in bytes";
+    }
+    cfg->max_buffer_size = (apr_size_t)size;
+
+    return NULL;
+}
+
+static const char *
+sundown_set_flush_size(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    sundown_config_rec *cfg = (sundown_config_rec *)mconfig;
+    apr_off_t size;
+    char *end;
+
+    if (strcasecmp(arg, "off") == 0) {
+        cfg->flush_size = 0;
+        return NULL;
+    }
+
+    if (apr_strtoff(&size, arg, &end, 10) != APR_SUCCESS || *end ||
+        size < 0) {
+        return "SundownFlushSize must be a size in bytes or Off";
+    }
+    cfg->flush_size = size;
+
+    return NULL;
+}
+
+static const char *
+sundown_set_max_nesting(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    sundown_config_rec *cfg = (sundown_config_rec *)mconfig;
+    int n;
+
+    n = atoi(arg);
+    if (n <= 0) {
+        return "SundownMaxNesting must be a positive integer";
+    }
+    cfg->max_nesting = n;
+
+    return NULL;
+}
+
+static const char *
+sundown_set_max_input_size(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    sundown_config_rec *cfg = (sundown_config_rec *)mconfig;
+    apr_off_t size;
+    char *end;
+
+    if (strcasecmp(arg, "off") == 0) {
+        cfg->max_input_size = 0;
+        return NULL;
+    }
+
+    if (apr_strtoff(&size, arg, &end, 10) != APR_SUCCESS || *end ||
+        size <= 0) {
+        return "SundownMaxInputSize must be a positive size in bytes or Off";
+    }
+    cfg->max_input_size = size;
+
+    return NULL;
+}
+
+static const char *
+sundown_set_max_remote_size(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    sundown_config_rec *cfg = (sundown_config_rec *)mconfig;
+    apr_off_t size;
+    char *end;
+
+    if (strcasecmp(arg, "off") == 0) {
+        cfg->max_remote_size = 0;
+        return NULL;
+    }
+
+    if (apr_strtoff(&size, arg, &end, 10) != APR_SUCCESS || *end ||
+        size <= 0) {
+        return "SundownMaxRemoteSize must be a positive size in bytes or Off";
+    }
+    cfg->max_remote_size = size;
+
+    return NULL;
+}
+
+static const char *
+sundown_set_max_work(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    sundown_config_rec *cfg = (sundown_config_rec *)mconfig;
+    apr_off_t steps;
+    char *end;
+
+    if (strcasecmp(arg, "off") == 0) {
+        cfg->max_work = 0;
+        return NULL;
+    }
+
+    if (apr_strtoff(&steps, arg, &end, 10) != APR_SUCCESS || *end ||
+        steps <= 0) {
+        return "SundownMaxWork must be a positive number or Off";
+    }
+    cfg->max_work = steps;
+
+    return NULL;
+}
+
+static const char *
+sundown_set_allocator(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    sundown_config_rec *cfg = (sundown_config_rec *)mconfig;
+
+    if (strcasecmp(arg, "arena") == 0) {
+        cfg->allocator = SUNDOWN_ALLOCATOR_ARENA;
+    } else if (strcasecmp(arg, "pool") == 0) {
+        cfg->allocator = SUNDOWN_ALLOCATOR_POOL;
+    } else if (strcasecmp(arg, "malloc") == 0) {
+        cfg->allocator = SUNDOWN_ALLOCATOR_MALLOC;
+    } else {
+        return "SundownAllocator must be Arena, Pool or Malloc";
+    }
+
+    return NULL;
+}
+
+static const char *
+sundown_set_cache_entries(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int n;
+
+    if (err != NULL) {
+        return err;
+    }
+
+    n = atoi(arg);
+    if (n < 0) {
+        return "SundownCacheEntries must be a non-negative integer";
+    }
+    sundown_cache.entries = n;
+
+    return NULL;
+}
+
+static const char *
+sundown_set_cache_entry_size(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int n;
+
+    if (err != NULL) {
+        return err;
+    }
+
+    n = atoi(arg);
+    if (n <= 0) {
+        return "SundownCacheEntrySize must be a positive integer";
+    }
+    sundown_cache.entry_size = n;
+
+    return NULL;
+}
+
+static const char *
+sundown_set_parallel_threads(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int n;
+
+    if (err != NULL) {
+        return err;
+    }
+
+    n = atoi(arg);
+    if (n < 0) {
+        return "SundownParallelThreads must be a non-negative integer";
+    }
+    sundown_parallel.threads = n;
+
+    return NULL;
+}
+
+static const char *
+sundown_set_parallel_size(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_off_t size;
+    char *end;
+
+    if (err != NULL) {
+        return err;
+    }
+
+    if (apr_strtoff(&size, arg, &end, 10) != APR_SUCCESS || *end ||
+        size <= 0) {
+        return "SundownParallelSize must be a positive size in bytes";
+    }
+    sundown_parallel.min_size = (apr_size_t)size;
+
+    return NULL;
+}
+
+static const char *
+sundown_set_block_maps(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int n;
+
+    if (err != NULL) {
+        return err;
+    }
+
+    n = atoi(arg);
+    if (n < 0) {
+        return "SundownBlockMaps must be a non-negative integer";
+    }
+    sundown_blockmaps.max = n;
+
+    return NULL;
+}
+
+static const char *
+sundown_set_block_map_size(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_off_t size;
+    char *end;
+
+    if (err != NULL) {
+        return err;
+    }
+
+    if (apr_strtoff(&size, arg, &end, 10) != APR_SUCCESS || *end ||
+        size < 0) {
+        return "SundownBlockMapSize must be a size in bytes";
+    }
+    sundown_blockmaps.min_size = (apr_size_t)size;
+
+    return NULL;
+}
+
+static const char *
+sundown_set_remote_cache(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int n;
+
+    if (err != NULL) {
+        return err;
+    }
+
+    n = atoi(arg);
+    if (n < 0) {
+        return "SundownRemoteCache must be a non-negative integer";
+    }
+    sundown_remotes.max = n;
+
+    return NULL;
+}
+
+static const char *
+sundown_set_remote_cache_ttl(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_off_t sec;
+    char *end;
+
+    if (err != NULL) {
+        return err;
+    }
+
+    if (apr_strtoff(&sec, arg, &end, 10) != APR_SUCCESS || *end || sec < 0) {
+        return "SundownRemoteCacheTTL must be a number of seconds";
+    }
+    sundown_remotes.ttl = apr_time_from_sec(sec);
+
+    return NULL;
+}
+
+static const char *
+sundown_set_remote_max_fetches(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int n;
+
+    if (err != NULL) {
+        return err;
+    }
+
+    n = atoi(arg);
+    if (n < 0) {
+        return "SundownRemoteMaxFetches must be a non-negative integer";
+    }
+    sundown_remotes.max_fetches = n;
+
+    return NULL;
+}
+
 static const command_rec
 sundown_cmds[] = {
     AP_INIT_TAKE1("SundownStylePath", ap_set_string_slot,
@@ -654,12 +3505,328 @@ sundown_cmds[] = {
                   (void *)APR_OFFSETOF(sundown_config_rec, class_task),
                   OR_ALL, "sundown task list class attributes"),
 #endif
+    AP_INIT_TAKE1("SundownMaxBufferSize", sundown_set_max_buffer_size,
+                  NULL, OR_ALL, "sundown maximum size of a render buffer"),
+    AP_INIT_TAKE1("SundownFlushSize", sundown_set_flush_size,
+                  NULL, OR_ALL, "sundown streaming output block size"),
+    AP_INIT_TAKE1("SundownMaxNesting", sundown_set_max_nesting,
+                  NULL, OR_ALL, "sundown maximum nesting of blocks and spans"),
+    AP_INIT_TAKE1("SundownMaxInputSize", sundown_set_max_input_size,
+                  NULL, OR_ALL, "sundown maximum size of the markdown input"),
+    AP_INIT_TAKE1("SundownMaxRemoteSize", sundown_set_max_remote_size,
+                  NULL, OR_ALL, "sundown maximum size of a url document"),
+    AP_INIT_TAKE1("SundownMaxWork", sundown_set_max_work,
+                  NULL, OR_ALL, "sundown maximum parse steps of a render"),
+    AP_INIT_TAKE1("SundownAllocator", sundown_set_allocator,
+                  NULL, OR_ALL, "sundown render memory (Arena, Pool or Malloc)"),
+    AP_INIT_TAKE1("SundownCacheEntries", sundown_set_cache_entries,
+                  NULL, RSRC_CONF, "sundown output cache entries"),
+    AP_INIT_TAKE1("SundownCacheEntrySize", sundown_set_cache_entry_size,
+                  NULL, RSRC_CONF, "sundown output cache entry size"),
+    AP_INIT_TAKE1("SundownParallelThreads", sundown_set_parallel_threads,
+                  NULL, RSRC_CONF, "sundown threads rendering large documents"),
+    AP_INIT_TAKE1("SundownParallelSize", sundown_set_parallel_size,
+                  NULL, RSRC_CONF, "sundown minimum size of a document "
+                  "rendered in parallel"),
+    AP_INIT_TAKE1("SundownBlockMaps", sundown_set_block_maps,
+                  NULL, RSRC_CONF, "sundown pages kept block by block"),
+    AP_INIT_TAKE1("SundownBlockMapSize", sundown_set_block_map_size,
+                  NULL, RSRC_CONF, "sundown minimum size of a page kept "
+                  "block by block"),
+    AP_INIT_TAKE1("SundownRemoteCache", sundown_set_remote_cache,
+                  NULL, RSRC_CONF, "sundown url documents kept"),
+    AP_INIT_TAKE1("SundownRemoteCacheTTL", sundown_set_remote_cache_ttl,
+                  NULL, RSRC_CONF, "sundown seconds a kept url document is "
+                  "used without asking upstream"),
+    AP_INIT_TAKE1("SundownRemoteMaxFetches", sundown_set_remote_max_fetches,
+                  NULL, RSRC_CONF, "sundown url fetches of all children at "
+                  "once"),
     {NULL}
 };
 
+static apr_status_t
+sundown_cache_cleanup(void *data)
+{
+    /* shm and mutex are released with the configuration pool */
+    sundown_stats_shm = NULL;
+    sundown_stats = NULL;
+    sundown_cache.mutex = NULL;
+    sundown_cache.shm = NULL;
+    sundown_cache.base = NULL;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t
+sundown_shm_create(apr_pool_t *p, apr_shm_t **shm, apr_size_t size,
+                   const char *name)
+{
+    apr_status_t rc;
+
+    rc = apr_shm_create(shm, size, NULL, p);
+    if (rc == APR_ENOTIMPL) {
+        const char *file = ap_server_root_relative(p, name);
+        apr_shm_remove(file, p);
+        rc = apr_shm_create(shm, size, file, p);
+    }
+
+    return rc;
+}
+
+static int
+sundown_pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp)
+{
+    memset(&sundown_cache, 0, sizeof(sundown_cache_rec));
+    memset(&sundown_styles, 0, sizeof(sundown_styles_rec));
+    memset(&sundown_parallel, 0, sizeof(sundown_parallel_rec));
+    memset(&sundown_blockmaps, 0, sizeof(sundown_blockmaps_rec));
+    memset(&sundown_remotes, 0, sizeof(sundown_remotes_rec));
+
+    sundown_cache.entry_size = SUNDOWN_CACHE_ENTRY_SIZE;
+    sundown_parallel.min_size = SUNDOWN_PARALLEL_SIZE;
+    sundown_blockmaps.min_size = SUNDOWN_BLOCKMAP_SIZE;
+    sundown_remotes.ttl = apr_time_from_sec(SUNDOWN_REMOTE_TTL);
+
+    return OK;
+}
+
+static int
+sundown_post_config(apr_pool_t *p, apr_pool_t *plog,
+                    apr_pool_t *ptemp, server_rec *s)
+{
+    apr_status_t rc;
+    apr_size_t size;
+    void *data = NULL;
+    const char *userdata_key = "sundown_post_config";
+
+    /* skip the first pass while the configuration is being checked */
+    apr_pool_userdata_get(&data, userdata_key, s->process->pool);
+    if (data == NULL) {
+        apr_pool_userdata_set((const void *)1, userdata_key,
+                              apr_pool_cleanup_null, s->process->pool);
+        return OK;
+    }
+
+    apr_pool_cleanup_register(p, NULL, sundown_cache_cleanup,
+                              apr_pool_cleanup_null);
+
+    /* counters */
+    rc = sundown_shm_create(p, &sundown_stats_shm, sizeof(sundown_stats_rec),
+                            "logs/sundown_stats");
+    if (rc != APR_SUCCESS) {
+        _SERR(s, "stats: failed to create shared memory");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    sundown_stats = apr_shm_baseaddr_get(sundown_stats_shm);
+    memset(sundown_stats, 0, sizeof(sundown_stats_rec));
+
+    if (sundown_cache.entries <= 0) {
+        return OK;
+    }
+
+    sundown_cache.slot_size = APR_ALIGN_DEFAULT(sizeof(sundown_cache_slot) +
+                                                sundown_cache.entry_size);
+    size = sundown_cache.slot_size * sundown_cache.entries;
+
+    rc = sundown_shm_create(p, &sundown_cache.shm, size, "logs/sundown_cache");
+    if (rc != APR_SUCCESS) {
+        _SERR(s, "cache: failed to create shared memory (%" APR_SIZE_T_FMT ")",
+              size);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    sundown_cache.base = apr_shm_baseaddr_get(sundown_cache.shm);
+    memset(sundown_cache.base, 0, size);
+
+    rc = apr_global_mutex_create(&sundown_cache.mutex, NULL,
+                                 APR_LOCK_DEFAULT, p);
+    if (rc != APR_SUCCESS) {
+        _SERR(s, "cache: failed to create global mutex");
+        apr_shm_destroy(sundown_cache.shm);
+        sundown_cache.shm = NULL;
+        sundown_cache.base = NULL;
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+#ifdef SUNDOWN_SET_MUTEX_PERMS
+#if AP_MODULE_MAGIC_AT_LEAST(20081201,0)
+    rc = ap_unixd_set_global_mutex_perms(sundown_cache.mutex);
+#else
+    rc = unixd_set_global_mutex_perms(sundown_cache.mutex);
+#endif
+    if (rc != APR_SUCCESS) {
+        _SERR(s, "cache: failed to set mutex permissions");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+#endif
+
+    return OK;
+}
+
+static void
+sundown_child_init(apr_pool_t *p, server_rec *s)
+{
+    if (sundown_cache.mutex) {
+        apr_status_t rc;
+
+        rc = apr_global_mutex_child_init(&sundown_cache.mutex,
+                                         apr_global_mutex_lockfile(
+                                             sundown_cache.mutex), p);
+        if (rc != APR_SUCCESS) {
+            _SERR(s, "cache: failed to attach global mutex");
+            sundown_cache.base = NULL;
+        }
+    }
+
+    /* style templates */
+    if (apr_pool_create(&sundown_styles.pool, p) != APR_SUCCESS) {
+        _SERR(s, "style: failed to create pool");
+        return;
+    }
+#if APR_HAS_THREADS
+    if (apr_thread_mutex_create(&sundown_styles.mutex,
+                                APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS) {
+        _SERR(s, "style: failed to create mutex");
+        return;
+    }
+#endif
+    sundown_styles.table = apr_hash_make(p);
+
+    /* block maps */
+    if (sundown_blockmaps.max > 0) {
+        if (apr_pool_create(&sundown_blockmaps.pool, p) != APR_SUCCESS) {
+            _SERR(s, "blocks: failed to create pool");
+        }
+#if APR_HAS_THREADS
+        else if (apr_thread_mutex_create(&sundown_blockmaps.mutex,
+                                         APR_THREAD_MUTEX_DEFAULT,
+                                         p) != APR_SUCCESS) {
+            _SERR(s, "blocks: failed to create mutex");
+        }
+#endif
+        else {
+            sundown_blockmaps.table = apr_hash_make(p);
+        }
+    }
+
+    /* url fetching */
+    if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK) {
+        _SERR(s, "url: failed to initialize curl");
+    } else if (apr_pool_create(&sundown_remotes.pool, p) != APR_SUCCESS) {
+        _SERR(s, "url: failed to create pool");
+        curl_global_cleanup();
+    }
+#if APR_HAS_THREADS
+    else if (apr_thread_mutex_create(&sundown_remotes.mutex,
+                                     APR_THREAD_MUTEX_DEFAULT,
+                                     p) != APR_SUCCESS) {
+        _SERR(s, "url: failed to create mutex");
+        curl_global_cleanup();
+    }
+#endif
+    else {
+        apr_pool_cleanup_register(p, NULL, remote_cleanup,
+                                  apr_pool_cleanup_null);
+        sundown_remotes.handles = apr_array_make(p, 8, sizeof(CURL *));
+        if (sundown_remotes.max > 0) {
+            sundown_remotes.table = apr_hash_make(p);
+        }
+#if APR_HAS_THREADS
+        sundown_remotes.flights = apr_hash_make(p);
+#endif
+
+        sundown_remotes.share = curl_share_init();
+        if (sundown_remotes.share) {
+#if APR_HAS_THREADS
+            int i;
+
+            for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+                apr_thread_mutex_create(&sundown_remotes.locks[i],
+                                        APR_THREAD_MUTEX_DEFAULT, p);
+            }
+            curl_share_setopt(sundown_remotes.share, CURLSHOPT_LOCKFUNC,
+                              remote_lock);
+            curl_share_setopt(sundown_remotes.share, CURLSHOPT_UNLOCKFUNC,
+                              remote_unlock);
+#endif
+            curl_share_setopt(sundown_remotes.share, CURLSHOPT_SHARE,
+                              CURL_LOCK_DATA_DNS);
+            curl_share_setopt(sundown_remotes.share, CURLSHOPT_SHARE,
+                              CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+            curl_share_setopt(sundown_remotes.share, CURLSHOPT_SHARE,
+                              CURL_LOCK_DATA_CONNECT);
+#endif
+        }
+    }
+
+#if APR_HAS_THREADS
+    /* parsers */
+    if (apr_threadkey_private_create(&sundown_parser_key,
+                                     sundown_parser_destroy,
+                                     p) != APR_SUCCESS) {
+        _SERR(s, "parser: failed to create thread key");
+        sundown_parser_key = NULL;
+    }
+
+    /* parallel rendering */
+    if (sundown_parallel.threads > 0 &&
+        apr_thread_pool_create(&sundown_parallel.pool, 0,
+                               sundown_parallel.threads, p) != APR_SUCCESS) {
+        _SERR(s, "parallel: failed to create thread pool");
+        sundown_parallel.pool = NULL;
+    }
+#endif
+}
+
+static int
+sundown_status_hook(request_rec *r, int flags)
+{
+    if (!sundown_stats) {
+        return OK;
+    }
+
+    if (flags & AP_STATUS_SHORT) {
+        ap_rprintf(r, "SundownBufferLimit: %u\n",
+                   apr_atomic_read32(&sundown_stats->buffer_limit));
+        ap_rprintf(r, "SundownBufferNoMem: %u\n",
+                   apr_atomic_read32(&sundown_stats->buffer_nomem));
+        ap_rprintf(r, "SundownInputLimit: %u\n",
+                   apr_atomic_read32(&sundown_stats->input_limit));
+        ap_rprintf(r, "SundownWorkLimit: %u\n",
+                   apr_atomic_read32(&sundown_stats->work_limit));
+        ap_rprintf(r, "SundownRemoteFetches: %u\n",
+                   apr_atomic_read32(&sundown_stats->remote_fetches));
+        ap_rprintf(r, "SundownRemoteLimit: %u\n",
+                   apr_atomic_read32(&sundown_stats->remote_limit));
+    } else {
+        ap_rputs("<hr />\n<h2>Sundown</h2>\n<dl>\n", r);
+        ap_rprintf(r, "<dt>Buffer limit exceeded: %u</dt>\n",
+                   apr_atomic_read32(&sundown_stats->buffer_limit));
+        ap_rprintf(r, "<dt>Buffer allocation failed: %u</dt>\n",
+                   apr_atomic_read32(&sundown_stats->buffer_nomem));
+        ap_rprintf(r, "<dt>Input size exceeded: %u</dt>\n",
+                   apr_atomic_read32(&sundown_stats->input_limit));
+        ap_rprintf(r, "<dt>Work budget exceeded: %u</dt>\n",
+                   apr_atomic_read32(&sundown_stats->work_limit));
+        ap_rprintf(r, "<dt>URL fetches in progress: %u</dt>\n",
+                   apr_atomic_read32(&sundown_stats->remote_fetches));
+        ap_rprintf(r, "<dt>URL fetches refused: %u</dt>\n",
+                   apr_atomic_read32(&sundown_stats->remote_limit));
+        ap_rputs("</dl>\n", r);
+    }
+
+    return OK;
+}
+
 static void
 sundown_register_hooks(apr_pool_t *p)
 {
+    APR_OPTIONAL_HOOK(ap, status_hook, sundown_status_hook,
+                      NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_pre_config(sundown_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_post_config(sundown_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(sundown_child_init, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_handler(sundown_handler, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2011, Vicent Marti
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_CHUNK (64 * 1024)
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(x) (((x) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	struct arena_chunk *prev;	/* large chunks only */
+	size_t size;	/* bytes after the header */
+	size_t used;
+};
+
+#define CHUNK_HEADER ARENA_ROUND(sizeof(struct arena_chunk))
+#define CHUNK_DATA(c) ((uint8_t *)(c) + CHUNK_HEADER)
+
+struct sd_arena {
+	struct buf_allocator allocator;
+	struct arena_chunk *chunks;	/* the current chunk comes first */
+	struct arena_chunk *large;	/* one allocation each */
+	size_t chunk;
+	uint8_t *last;	/* last allocation of the current chunk */
+};
+
+/* arena_large • allocations of more than a quarter of a chunk are not
+ * carved out of one; this only depends on the size */
+static int
+arena_large(const struct sd_arena *arena, size_t size)
+{
+	return size > arena->chunk / 4;
+}
+
+static void *
+arena_alloc_large(struct sd_arena *arena, size_t size)
+{
+	struct arena_chunk *c = malloc(CHUNK_HEADER + size);
+
+	if (!c)
+		return NULL;
+
+	c->size = c->used = size;
+	c->prev = NULL;
+	c->next = arena->large;
+	if (arena->large)
+		arena->large->prev = c;
+	arena->large = c;
+
+	return CHUNK_DATA(c);
+}
+
+static void *
+arena_realloc_large(struct sd_arena *arena, void *ptr, size_t size)
+{
+	struct arena_chunk *c = (struct arena_chunk *)((uint8_t *)ptr - CHUNK_HEADER);
+
+	c = realloc(c, CHUNK_HEADER + size);
+	if (!c)
+		return NULL;
+
+	c->size = c->used = size;
+	if (c->prev)
+		c->prev->next = c;
+	else
+		arena->large = c;
+	if (c->next)
+		c->next->prev = c;
+
+	return CHUNK_DATA(c);
+}
+
+void *
+sd_arena_alloc(struct sd_arena *arena, size_t size)
+{
+	struct arena_chunk *c = arena->chunks;
+	size_t rounded = ARENA_ROUND(size ? size : 1);
+
+	if (arena_large(arena, size))
+		return arena_alloc_large(arena, size);
+
+	if (!c || c->size - c->used < rounded) {
+		c = malloc(CHUNK_HEADER + arena->chunk);
+		if (!c)
+			return NULL;
+
+		c->size = arena->chunk;
+		c->used = 0;
+		c->prev = NULL;
+		c->next = arena->chunks;
+		arena->chunks = c;
+	}
+
+	arena->last = CHUNK_DATA(c) + c->used;
+	c->used += rounded;
+
+	return arena->last;
+}
+
+static void *
+arena_realloc(void *opaque, void *ptr, size_t size, size_t neosize)
+{
+	struct sd_arena *arena = opaque;
+	struct arena_chunk *c = arena->chunks;
+	void *neo;
+
+	if (!ptr)
+		return sd_arena_alloc(arena, neosize);
+
+	if (neosize <= size)
+		return ptr;
+
+	if (arena_large(arena, size))
+		return arena_realloc_large(arena, ptr, neosize);
+
+	/* the last allocation grows in place while the chunk has room */
+	if (ptr == arena->last && !arena_large(arena, neosize)) {
+		size_t offset = (uint8_t *)ptr - CHUNK_DATA(c);
+
+		if (c->size - offset >= ARENA_ROUND(neosize)) {
+			c->used = offset + ARENA_ROUND(neosize);
+			return ptr;
+		}
+	}
+
+	neo = sd_arena_alloc(arena, neosize);
+	if (neo)
+		memcpy(neo, ptr, size);
+
+	return neo;
+}
+
+struct sd_arena *
+sd_arena_new(size_t chunk)
+{
+	struct sd_arena *arena = malloc(sizeof(struct sd_arena));
+
+	if (!arena)
+		return NULL;
+
+	arena->allocator.realloc = arena_realloc;
+	arena->allocator.free = NULL;
+	arena->allocator.opaque = arena;
+	arena->chunks = NULL;
+	arena->large = NULL;
+	arena->chunk = chunk ? ARENA_ROUND(chunk) : ARENA_CHUNK;
+	arena->last = NULL;
+
+	return arena;
+}
+
+const struct buf_allocator *
+sd_arena_allocator(struct sd_arena *arena)
+{
+	return &arena->allocator;
+}
+
+void
+sd_arena_reset(struct sd_arena *arena)
+{
+	struct arena_chunk *c, *next;
+
+	for (c = arena->large; c; c = next) {
+		next = c->next;
+		free(c);
+	}
+	arena->large = NULL;
+
+	if (arena->chunks) {
+		for (c = arena->chunks->next; c; c = next) {
+			next = c->next;
+			free(c);
+		}
+		arena->chunks->next = NULL;
+		arena->chunks->used = 0;
+	}
+
+	arena->last = NULL;
+}
+
+void
+sd_arena_free(struct sd_arena *arena)
+{
+	if (!arena)
+		return;
+
+	sd_arena_reset(arena);
+	free(arena->chunks);
+	free(arena);
+}
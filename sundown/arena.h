@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2011, Vicent Marti
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ARENA_H__
+#define ARENA_H__
+
+#include <stddef.h>
+
+#include "buffer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* sd_arena: bump allocator for memory released all at once; allocations
+ * are carved out of chunks, larger ones get a chunk of their own */
+struct sd_arena;
+
+/* sd_arena_new: arena of `chunk` bytes chunks (0 for the default) */
+struct sd_arena *sd_arena_new(size_t chunk);
+
+/* sd_arena_alloc: memory valid until the next reset, NULL when out of
+ * memory */
+void *sd_arena_alloc(struct sd_arena *, size_t);
+
+/* sd_arena_allocator: buffer allocator drawing from the arena; a buffer
+ * grown last is extended in place */
+const struct buf_allocator *sd_arena_allocator(struct sd_arena *);
+
+/* sd_arena_reset: releases every allocation, keeping one chunk */
+void sd_arena_reset(struct sd_arena *);
+
+void sd_arena_free(struct sd_arena *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -17,6 +17,8 @@
 
 #define BUFFER_MAX_ALLOC_SIZE (1024 * 1024 * 16) //16mb
 
+#define BUFFER_LIMIT(b) ((b)->limit ? (b)->limit : BUFFER_MAX_ALLOC_SIZE)
+
 #include "buffer.h"
 
 #include <stdio.h>
@@ -57,17 +59,26 @@ bufgrow(struct buf *buf, size_t neosz)
 
 	assert(buf && buf->unit);
 
-	if (neosz > BUFFER_MAX_ALLOC_SIZE)
-		return BUF_ENOMEM;
+	if (neosz > BUFFER_LIMIT(buf))
+		return BUF_ELIMIT;
 
 	if (buf->asize >= neosz)
 		return BUF_OK;
 
-	neoasz = buf->asize + buf->unit;
-	while (neoasz < neosz)
-		neoasz += buf->unit;
+	if (buf->growth == BUF_GROW_GEOMETRIC) {
+		neoasz = buf->asize;
+		while (neoasz < neosz)
+			neoasz += (neoasz / 2 > buf->unit) ? neoasz / 2 : buf->unit;
+	} else {
+		neoasz = buf->asize + buf->unit;
+		while (neoasz < neosz)
+			neoasz += buf->unit;
+	}
 
-	neodata = realloc(buf->data, neoasz);
+	if (neoasz > BUFFER_LIMIT(buf))
+		neoasz = BUFFER_LIMIT(buf);
+
+	neodata = bufrealloc(buf->allocator, buf->data, buf->asize, neoasz);
 	if (!neodata)
 		return BUF_ENOMEM;
 
@@ -76,22 +87,95 @@ bufgrow(struct buf *buf, size_t neosz)
 	return BUF_OK;
 }
 
+/* bufgrow_write: growing for data about to be written, the data is
+ * dropped on failure so the first error is kept in the buffer */
+static int
+bufgrow_write(struct buf *buf, size_t neosz)
+{
+	int err = bufgrow(buf, neosz);
+
+	if (err < 0 && buf->error == BUF_OK)
+		buf->error = err;
+
+	return err;
+}
+
+/* bufreserve: making room for at least the given number of extra bytes */
+int
+bufreserve(struct buf *buf, size_t len)
+{
+	assert(buf && buf->unit);
+
+	if (len > BUFFER_LIMIT(buf) - buf->size)
+		return BUF_ELIMIT;
+
+	return bufgrow(buf, buf->size + len);
+}
+
+/* bufsetgrowth: selecting the growth policy of the buffer */
+void
+bufsetgrowth(struct buf *buf, bufgrowth_t growth)
+{
+	assert(buf);
+
+	buf->growth = growth;
+}
+
+/* bufsetlimit: setting the allocation limit of the buffer (0 = default) */
+void
+bufsetlimit(struct buf *buf, size_t limit)
+{
+	assert(buf);
+
+	buf->limit = limit;
+}
 
 /* bufnew: allocation of a new buffer */
 struct buf *
 bufnew(size_t unit)
+{
+	return bufnew_alloc(unit, NULL);
+}
+
+/* bufnew_alloc: allocation of a new buffer from an allocator */
+struct buf *
+bufnew_alloc(size_t unit, const struct buf_allocator *allocator)
 {
 	struct buf *ret;
-	ret = malloc(sizeof (struct buf));
+	ret = bufrealloc(allocator, NULL, 0, sizeof (struct buf));
 
 	if (ret) {
 		ret->data = 0;
 		ret->size = ret->asize = 0;
 		ret->unit = unit;
+		ret->growth = BUF_GROW_LINEAR;
+		ret->limit = 0;
+		ret->error = BUF_OK;
+		ret->allocator = allocator;
 	}
 	return ret;
 }
 
+/* bufrealloc: allocating memory from an allocator (NULL for malloc) */
+void *
+bufrealloc(const struct buf_allocator *allocator, void *ptr, size_t size, size_t neosize)
+{
+	if (!allocator)
+		return realloc(ptr, neosize);
+
+	return allocator->realloc(allocator->opaque, ptr, size, neosize);
+}
+
+/* buffree: giving memory back to an allocator (NULL for malloc) */
+void
+buffree(const struct buf_allocator *allocator, void *ptr)
+{
+	if (!allocator)
+		free(ptr);
+	else if (allocator->free)
+		allocator->free(allocator->opaque, ptr);
+}
+
 /* bufnullterm: NULL-termination of the string array */
 const char *
 bufcstr(struct buf *buf)
@@ -118,7 +202,7 @@ bufprintf(struct buf *buf, const char *fmt, ...)
 
 	assert(buf && buf->unit);
 
-	if (buf->size >= buf->asize && bufgrow(buf, buf->size + 1) < 0)
+	if (buf->size >= buf->asize && bufgrow_write(buf, buf->size + 1) < 0)
 		return;
 	
 	va_start(ap, fmt);
@@ -136,7 +220,7 @@ bufprintf(struct buf *buf, const char *fmt, ...)
 	}
 
 	if ((size_t)n >= buf->asize - buf->size) {
-		if (bufgrow(buf, buf->size + n + 1) < 0)
+		if (bufgrow_write(buf, buf->size + n + 1) < 0)
 			return;
 
 		va_start(ap, fmt);
@@ -156,7 +240,7 @@ bufput(struct buf *buf, const void *data, size_t len)
 {
 	assert(buf && buf->unit);
 
-	if (buf->size + len > buf->asize && bufgrow(buf, buf->size + len) < 0)
+	if (buf->size + len > buf->asize && bufgrow_write(buf, buf->size + len) < 0)
 		return;
 
 	memcpy(buf->data + buf->size, data, len);
@@ -177,7 +261,7 @@ bufputc(struct buf *buf, int c)
 {
 	assert(buf && buf->unit);
 
-	if (buf->size + 1 > buf->asize && bufgrow(buf, buf->size + 1) < 0)
+	if (buf->size + 1 > buf->asize && bufgrow_write(buf, buf->size + 1) < 0)
 		return;
 
 	buf->data[buf->size] = c;
@@ -191,8 +275,8 @@ bufrelease(struct buf *buf)
 	if (!buf)
 		return;
 
-	free(buf->data);
-	free(buf);
+	buffree(buf->allocator, buf->data);
+	buffree(buf->allocator, buf);
 }
 
 
@@ -203,9 +287,10 @@ bufreset(struct buf *buf)
 	if (!buf)
 		return;
 
-	free(buf->data);
+	buffree(buf->allocator, buf->data);
 	buf->data = NULL;
 	buf->size = buf->asize = 0;
+	buf->error = BUF_OK;
 }
 
 /* bufslurp: removes a given number of bytes from the head of the array */
@@ -34,23 +34,42 @@ extern "C" {
 typedef enum {
 	BUF_OK = 0,
 	BUF_ENOMEM = -1,
+	BUF_ELIMIT = -2,
 } buferror_t;
 
+typedef enum {
+	BUF_GROW_LINEAR = 0,	/* add `unit` until large enough */
+	BUF_GROW_GEOMETRIC = 1,	/* add half the allocated size, at least `unit` */
+} bufgrowth_t;
+
+/* struct buf_allocator: memory of a buffer; realloc gets the current size
+ * (0 with a NULL ptr for new memory), free is NULL when the memory is
+ * released all at once by its owner */
+struct buf_allocator {
+	void *(*realloc)(void *opaque, void *ptr, size_t size, size_t neosize);
+	void (*free)(void *opaque, void *ptr);
+	void *opaque;
+};
+
 /* struct buf: character array buffer */
 struct buf {
 	uint8_t *data;		/* actual character data */
 	size_t size;	/* size of the string */
 	size_t asize;	/* allocated size (0 = volatile buffer) */
 	size_t unit;	/* reallocation unit size (0 = read-only buffer) */
+	unsigned int growth;	/* growth policy (bufgrowth_t) */
+	size_t limit;	/* allocation limit (0 = default limit) */
+	int error;	/* first failed write (buferror_t), sticky */
+	const struct buf_allocator *allocator;	/* NULL for malloc */
 };
 
 /* CONST_BUF: global buffer from a string litteral */
 #define BUF_STATIC(string) \
-	{ (uint8_t *)string, sizeof string -1, sizeof string, 0, 0 }
+	{ (uint8_t *)string, sizeof string -1, sizeof string, 0, 0, 0, 0, 0 }
 
 /* VOLATILE_BUF: macro for creating a volatile buffer on the stack */
 #define BUF_VOLATILE(strname) \
-	{ (uint8_t *)strname, strlen(strname), 0, 0, 0 }
+	{ (uint8_t *)strname, strlen(strname), 0, 0, 0, 0, 0, 0 }
 
 /* BUFPUTSL: optimized bufputs of a string litteral */
 #define BUFPUTSL(output, literal) \
@@ -59,9 +78,28 @@ struct buf {
 /* bufgrow: increasing the allocated size to the given value */
 int bufgrow(struct buf *, size_t);
 
+/* bufreserve: making room for at least the given number of extra bytes */
+int bufreserve(struct buf *, size_t);
+
+/* bufsetgrowth: selecting the growth policy of the buffer */
+void bufsetgrowth(struct buf *, bufgrowth_t);
+
+/* bufsetlimit: setting the allocation limit of the buffer (0 = default) */
+void bufsetlimit(struct buf *, size_t);
+
 /* bufnew: allocation of a new buffer */
 struct buf *bufnew(size_t) __attribute__ ((malloc));
 
+/* bufnew_alloc: allocation of a new buffer from an allocator (NULL for
+ * malloc), the buffer structure included */
+struct buf *bufnew_alloc(size_t, const struct buf_allocator *);
+
+/* bufrealloc: allocating memory from an allocator (NULL for malloc) */
+void *bufrealloc(const struct buf_allocator *, void *, size_t, size_t);
+
+/* buffree: giving memory back to an allocator (NULL for malloc) */
+void buffree(const struct buf_allocator *, void *);
+
 /* bufnullterm: NUL-termination of the string array (making a C-string) */
 const char *bufcstr(struct buf *);
 
@@ -3,8 +3,9 @@
 #include <string.h>
 
 #include "houdini.h"
+#include "scan.h"
 
-#define ESCAPE_GROW_FACTOR(x) (((x) * 12) / 10)
+#define ESCAPE_GROW_FACTOR(x) ((x) * 3) /* every byte as %XX */
 
 /*
  * The following characters will not be escaped:
@@ -50,6 +51,9 @@ static const char HREF_SAFE[] = {
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 };
 
+/* finds the bytes that are not in HREF_SAFE */
+static struct sd_scan HREF_ESCAPE_SCAN;
+
 void
 houdini_escape_href(struct buf *ob, const uint8_t *src, size_t size)
 {
@@ -57,13 +61,14 @@ houdini_escape_href(struct buf *ob, const uint8_t *src, size_t size)
 	size_t  i = 0, org;
 	char hex_str[3];
 
-	bufgrow(ob, ESCAPE_GROW_FACTOR(size));
+	sd_scan_once(&HREF_ESCAPE_SCAN, (const uint8_t *)HREF_SAFE, 1);
+
+	bufreserve(ob, ESCAPE_GROW_FACTOR(size));
 	hex_str[0] = '%';
 
 	while (i < size) {
 		org = i;
-		while (i < size && HREF_SAFE[src[i]] != 0)
-			i++;
+		i += sd_scan_find(&HREF_ESCAPE_SCAN, src + i, size - i);
 
 		if (i > org)
 			bufput(ob, src + org, i - org);
@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "houdini.h"
+#include "scan.h"
 
 #define ESCAPE_GROW_FACTOR(x) (((x) * 12) / 10) /* this is very scientific, yes */
 
@@ -46,17 +47,22 @@ static const char *HTML_ESCAPES[] = {
         "&gt;"
 };
 
+static const size_t HTML_ESCAPES_SIZE[] = { 0, 6, 5, 5, 5, 4, 4 };
+
+static struct sd_scan HTML_ESCAPE_SCAN;
+
 void
 houdini_escape_html0(struct buf *ob, const uint8_t *src, size_t size, int secure)
 {
 	size_t i = 0, org, esc = 0;
 
-	bufgrow(ob, ESCAPE_GROW_FACTOR(size));
+	sd_scan_once(&HTML_ESCAPE_SCAN, (const uint8_t *)HTML_ESCAPE_TABLE, 0);
+
+	bufreserve(ob, ESCAPE_GROW_FACTOR(size));
 
 	while (i < size) {
 		org = i;
-		while (i < size && (esc = HTML_ESCAPE_TABLE[src[i]]) == 0)
-			i++;
+		i += sd_scan_find(&HTML_ESCAPE_SCAN, src + i, size - i);
 
 		if (i > org)
 			bufput(ob, src + org, i - org);
@@ -65,11 +71,13 @@ houdini_escape_html0(struct buf *ob, const uint8_t *src, size_t size, int secure
 		if (i >= size)
 			break;
 
+		esc = HTML_ESCAPE_TABLE[src[i]];
+
 		/* The forward slash is only escaped in secure mode */
 		if (src[i] == '/' && !secure) {
 			bufputc(ob, '/');
 		} else {
-			bufputs(ob, HTML_ESCAPES[esc]);
+			bufput(ob, HTML_ESCAPES[esc], HTML_ESCAPES_SIZE[esc]);
 		}
 
 		i++;
@@ -260,6 +260,97 @@ rndr_linebreak(struct buf *ob, void *opaque)
 	return 1;
 }
 
+/* toc_anchor: id given by the header attributes, "{#id .class}" */
+static int
+toc_anchor(const struct buf *attr, size_t *start, size_t *end)
+{
+	size_t n, i = 0;
+
+	do {
+		i++;
+	} while (i < attr->size && attr->data[i-1] != '#');
+
+	if (i >= attr->size)
+		return 0;
+
+	n = i;
+	while (n < attr->size && attr->data[n] != '#' &&
+	       attr->data[n] != '.' && attr->data[n] != ' ')
+		n++;
+
+	*start = i;
+	*end = n;
+	return 1;
+}
+
+/* toc_push: room for one more entry, counted once it is written */
+static struct sdhtml_toc_entry *
+toc_push(struct sdhtml_toc *toc)
+{
+	if (toc->size == toc->asize) {
+		size_t asize = toc->asize ? toc->asize * 2 : 16;
+		struct sdhtml_toc_entry *item = bufrealloc(toc->data->allocator, toc->item,
+			toc->asize * sizeof(struct sdhtml_toc_entry), asize * sizeof(struct sdhtml_toc_entry));
+
+		if (!item) {
+			if (toc->error == BUF_OK)
+				toc->error = BUF_ENOMEM;
+			return NULL;
+		}
+
+		toc->item = item;
+		toc->asize = asize;
+	}
+
+	return &toc->item[toc->size];
+}
+
+/* toc_pushed: counts the entry unless its anchor or text was dropped */
+static void
+toc_pushed(struct sdhtml_toc *toc)
+{
+	if (toc->data->error != BUF_OK) {
+		if (toc->error == BUF_OK)
+			toc->error = toc->data->error;
+		return;
+	}
+
+	toc->size++;
+}
+
+void
+sdhtml_toc_collect(const struct buf *text, const struct buf *attr, int level, void *opaque)
+{
+	struct html_renderopt *options = opaque;
+	struct sdhtml_toc *toc = options->toc_data.entries;
+	struct sdhtml_toc_entry *entry;
+	size_t start = 0, end = 0;
+
+	if (!toc || !(entry = toc_push(toc)))
+		return;
+
+	entry->level = level;
+	entry->has_anchor = 1;
+	entry->anchor = toc->data->size;
+
+	if (attr && attr->size) {
+		entry->has_anchor = toc_anchor(attr, &start, &end);
+		if (entry->has_anchor)
+			bufput(toc->data, attr->data + start, end - start);
+	} else {
+		/* numbered by rndr_header, called right before */
+		bufprintf(toc->data, "toc_%d", options->toc_data.header_count - 1);
+	}
+	entry->anchor_size = toc->data->size - entry->anchor;
+
+	entry->text = toc->data->size;
+	if (text)
+		bufput(toc->data, text->data, text->size);
+	entry->text_size = toc->data->size - entry->text;
+
+	toc_pushed(toc);
+}
+
 static void
 rndr_header(struct buf *ob, const struct buf *text, const struct buf *attr, int level, void *opaque)
 {
@@ -273,7 +364,7 @@ rndr_header(struct buf *ob, const struct buf *text, const struct buf *attr, int
         rndr_attributes(ob, attr->data, attr->size, opaque);
         bufputc(ob, '>');
     }
-    else if (options->flags & HTML_TOC)
+    else if ((options->flags & HTML_TOC) || options->toc_data.entries)
 		bufprintf(ob, "<h%d id=\"toc_%d\">", level, options->toc_data.header_count++);
 	else
 		bufprintf(ob, "<h%d>", level);
@@ -668,16 +759,8 @@ toc_header(struct buf *ob, const struct buf *text, const struct buf *attr, int l
 	}
 
     if (attr && attr->size) {
-        size_t n, i = 0;
-        do {
-            i++;
-        } while (i < attr->size && attr->data[i-1] != '#');
-        if (i < attr->size) {
-            n = i;
-            while (n < attr->size && attr->data[n] != '#' &&
-                   attr->data[n] != '.' && attr->data[n] != ' ') {
-                n++;
-            }
+        size_t i, n;
+        if (toc_anchor(attr, &i, &n)) {
             BUFPUTSL(ob, "<a href=\"#");
             escape_html(ob, attr->data + i, n - i);
             BUFPUTSL(ob, "\">");
@@ -710,6 +793,128 @@ toc_finalize(struct buf *ob, void *opaque)
 	}
 }
 
+void
+sdhtml_toc_entries(struct buf *ob, struct html_renderopt *options)
+{
+	const struct sdhtml_toc *toc = options->toc_data.entries;
+	size_t i;
+	int level, current_level = 0, level_offset = 0, is_class = 0;
+	int begin_level = options->toc_data.begin_level;
+	int end_level = options->toc_data.end_level;
+
+	for (i = 0; toc && i < toc->size; ++i) {
+		const struct sdhtml_toc_entry *entry = &toc->item[i];
+
+		level = entry->level;
+		if (begin_level && level < begin_level)
+			continue;
+		if (end_level && end_level >= begin_level && level > end_level)
+			continue;
+
+		/* same layout as toc_header */
+		if (current_level == 0)
+			level_offset = level - 1;
+		level -= level_offset;
+
+		if (level > current_level) {
+			while (level > current_level) {
+				if (!is_class && options->toc_data.class)
+					bufprintf(ob, "<ul class=\"%s\">\n<li>\n",
+					          options->toc_data.class);
+				else
+					BUFPUTSL(ob, "<ul>\n<li>\n");
+				is_class = 1;
+				current_level++;
+			}
+		} else if (level < current_level) {
+			BUFPUTSL(ob, "</li>\n");
+			while (level < current_level) {
+				BUFPUTSL(ob, "</ul>\n</li>\n");
+				current_level--;
+			}
+			BUFPUTSL(ob, "<li>\n");
+		} else {
+			BUFPUTSL(ob, "</li>\n<li>\n");
+		}
+
+		if (entry->has_anchor) {
+			BUFPUTSL(ob, "<a href=\"#");
+			escape_html(ob, toc->data->data + entry->anchor, entry->anchor_size);
+			BUFPUTSL(ob, "\">");
+		}
+
+		bufput(ob, toc->data->data + entry->text, entry->text_size);
+		BUFPUTSL(ob, "</a>\n");
+	}
+
+	while (current_level > 0) {
+		BUFPUTSL(ob, "</li>\n</ul>\n");
+		current_level--;
+	}
+}
+
+struct sdhtml_toc *
+sdhtml_toc_new(struct buf *data)
+{
+	struct sdhtml_toc *toc;
+
+	if (!data)
+		return NULL;
+
+	toc = bufrealloc(data->allocator, NULL, 0, sizeof(struct sdhtml_toc));
+	if (!toc) {
+		bufrelease(data);
+		return NULL;
+	}
+
+	toc->item = NULL;
+	toc->size = 0;
+	toc->asize = 0;
+	toc->data = data;
+	toc->error = BUF_OK;
+
+	return toc;
+}
+
+void
+sdhtml_toc_free(struct sdhtml_toc *toc)
+{
+	const struct buf_allocator *allocator;
+
+	if (!toc)
+		return;
+
+	allocator = toc->data->allocator;
+	buffree(allocator, toc->item);
+	bufrelease(toc->data);
+	buffree(allocator, toc);
+}
+
+void
+sdhtml_toc_append(struct sdhtml_toc *toc, const struct sdhtml_toc *src, size_t first, size_t count)
+{
+	size_t i;
+
+	if (src->error != BUF_OK && toc->error == BUF_OK)
+		toc->error = src->error;
+
+	for (i = first; i < src->size && i < first + count; ++i) {
+		const struct sdhtml_toc_entry *from = &src->item[i];
+		struct sdhtml_toc_entry *entry = toc_push(toc);
+
+		if (!entry)
+			return;
+
+		*entry = *from;
+		entry->anchor = toc->data->size;
+		bufput(toc->data, src->data->data + from->anchor, from->anchor_size);
+		entry->text = toc->data->size;
+		bufput(toc->data, src->data->data + from->text, from->text_size);
+
+		toc_pushed(toc);
+	}
+}
+
 void
 sdhtml_toc_renderer(struct sd_callbacks *callbacks, struct html_renderopt *options)
 {
@@ -25,6 +25,26 @@
 extern "C" {
 #endif
 
+/* sdhtml_toc_entry: a header collected by sdhtml_renderer; its anchor and
+ * text are at the given offsets of the entry list data */
+struct sdhtml_toc_entry {
+	int level;
+	int has_anchor;
+	size_t anchor;
+	size_t anchor_size;
+	size_t text;
+	size_t text_size;
+};
+
+/* sdhtml_toc: collected headers, in document order */
+struct sdhtml_toc {
+	struct sdhtml_toc_entry *item;
+	size_t size;
+	size_t asize;
+	struct buf *data;	/* anchors and texts of the entries */
+	int error;	/* first dropped entry (buferror_t), sticky */
+};
+
 struct html_renderopt {
 	struct {
 		int header_count;
@@ -34,6 +54,7 @@ struct html_renderopt {
 		int end_level;
 		int is_class;
 		char *class;
+		struct sdhtml_toc *entries;	/* headers collected by sdhtml_renderer */
 	} toc_data;
 
     struct {
@@ -78,6 +99,28 @@ sdhtml_renderer(struct sd_callbacks *callbacks, struct html_renderopt *options_p
 extern void
 sdhtml_toc_renderer(struct sd_callbacks *callbacks, struct html_renderopt *options_ptr);
 
+/* sdhtml_toc_entries: writes the table of contents from the headers that
+ * sdhtml_renderer collected into options->toc_data.entries */
+extern void
+sdhtml_toc_entries(struct buf *ob, struct html_renderopt *options_ptr);
+
+/* sdhtml_toc_collect: header text callback of sd_markdown_set_header_text
+ * with the options of sdhtml_renderer, collects into toc_data.entries */
+extern void
+sdhtml_toc_collect(const struct buf *text, const struct buf *attr, int level, void *opaque);
+
+/* sdhtml_toc_new: an empty entry list writing into `data`, which it owns
+ * from then on; the entries come from the allocator of `data` */
+extern struct sdhtml_toc *
+sdhtml_toc_new(struct buf *data);
+
+extern void
+sdhtml_toc_free(struct sdhtml_toc *toc);
+
+/* sdhtml_toc_append: appends `count` entries of `src` from `first` */
+extern void
+sdhtml_toc_append(struct sdhtml_toc *toc, const struct sdhtml_toc *src, size_t first, size_t count);
+
 extern void
 sdhtml_smartypants(struct buf *ob, const uint8_t *text, size_t size);
 
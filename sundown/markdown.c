@@ -19,6 +19,8 @@
 
 #include "markdown.h"
 #include "stack.h"
+#include "arena.h"
+#include "scan.h"
 
 #include <assert.h>
 #include <string.h>
@@ -29,8 +31,6 @@
 #define strncasecmp	_strnicmp
 #endif
 
-#define REF_TABLE_SIZE 8
-
 #define BUFFER_BLOCK 0
 #define BUFFER_SPAN 1
 #define BUFFER_ATTRIBUTE 2
@@ -46,14 +46,42 @@
  * LOCAL TYPES *
  ***************/
 
-/* link_ref: reference to a link */
+/* link_ref: reference to a link, its buffers point into link_refs.data */
 struct link_ref {
 	unsigned int id;
 
-	struct buf *link;
-	struct buf *title;
+	struct buf name;	/* lower case */
+	struct buf link;
+	struct buf title;
+};
 
-	struct link_ref *next;
+/* link_refs: references of a document, in the order they were defined,
+ * with an open addressing index built once all of them are known */
+struct link_refs {
+	struct link_ref *item;
+	size_t size;
+	size_t asize;
+	struct buf *data;	/* names, links and titles */
+	size_t *slots;		/* index + 1 into item, 0 for a free slot */
+	size_t mask;
+	const struct buf_allocator *allocator;
+};
+
+/* sd_document: input after the first pass */
+struct sd_document {
+	struct buf *text;
+	struct link_refs refs;
+	const struct buf_allocator *allocator;
+};
+
+/* emph_memo: delimiter chains of an inline run already followed to its end
+ * without finding a closing delimiter */
+struct emph_memo {
+	const uint8_t *end;	/* end of the run, positions count back from it */
+	size_t size;
+	uint16_t *failed;	/* per position, one bit per EMPH_BIT */
+	const uint8_t *last[3];	/* last '`', ']' and ')' of the run */
+	int found;		/* bits of the last[] already looked up */
 };
 
 /* char_trigger: function pointer to render active chars */
@@ -111,18 +139,55 @@ struct sd_markdown {
 	struct sd_callbacks	cb;
 	void *opaque;
 
-	struct link_ref *refs[REF_TABLE_SIZE];
+	const struct link_refs *refs;
 	uint8_t active_char[256];
+	struct sd_scan active_scan;
 	struct stack work_bufs[3];
 	unsigned int ext_flags;
 	size_t max_nesting;
+	size_t buffer_limit;
+	const struct buf_allocator *allocator;	/* instance, NULL for malloc */
+	const struct buf_allocator *render;	/* per render, NULL for allocator */
+	size_t budget;	/* work steps allowed per render, 0 for no limit */
+	size_t spent;
 	int in_link_body;
+	size_t links;	/* links rendered, a header without any is its own text */
+	int links_as_text;	/* header text: links give their content only */
+	void (*header_text)(const struct buf *text, const struct buf *attr, int level, void *opaque);
+	void *header_text_opaque;
+
+	/* emphasis searches of the current inline run */
+	struct emph_memo emph;
+	size_t *emph_trail;
+	size_t emph_trail_size;
+	size_t emph_trail_asize;
+
+	/* streaming of top-level blocks */
+	void (*flush)(const uint8_t *data, size_t size, void *opaque);
+	void *flush_opaque;
+	size_t flush_size;
+	struct buf *flush_ob;
+
+	/* rendering of a range of top-level blocks */
+	struct buf *range_ob;
+	size_t range_end;	/* no block is started at or after it */
+	size_t range_next;	/* where the last top-level block ended */
+	const uint8_t *range_text;	/* text being rendered, to its end */
+	const uint8_t *range_text_end;
+	const uint8_t *range_reach;	/* furthest byte of the text searched */
 };
 
 /***************************
  * HELPER FUNCTIONS *
  ***************************/
 
+/* rndr_allocator • memory of the current render */
+static inline const struct buf_allocator *
+rndr_allocator(struct sd_markdown *rndr)
+{
+	return rndr->render ? rndr->render : rndr->allocator;
+}
+
 static inline struct buf *
 rndr_newbuf(struct sd_markdown *rndr, int type)
 {
@@ -135,10 +200,13 @@ rndr_newbuf(struct sd_markdown *rndr, int type)
 		work = pool->item[pool->size++];
 		work->size = 0;
 	} else {
-		work = bufnew(buf_size[type]);
+		work = bufnew_alloc(buf_size[type], rndr_allocator(rndr));
+		bufsetgrowth(work, BUF_GROW_GEOMETRIC);
 		stack_push(pool, work);
 	}
 
+	work->limit = rndr->buffer_limit;
+
 	return work;
 }
 
@@ -148,6 +216,91 @@ rndr_popbuf(struct sd_markdown *rndr, int type)
 	rndr->work_bufs[type].size--;
 }
 
+/* rndr_calloc • zeroed memory of the current render */
+static void *
+rndr_calloc(struct sd_markdown *rndr, size_t count, size_t size)
+{
+	void *ptr = bufrealloc(rndr_allocator(rndr), NULL, 0, count * size);
+
+	if (ptr)
+		memset(ptr, 0x0, count * size);
+
+	return ptr;
+}
+
+static inline void
+rndr_free(struct sd_markdown *rndr, void *ptr)
+{
+	buffree(rndr_allocator(rndr), ptr);
+}
+
+/* rndr_spend • charges steps to the work budget, 0 once it is spent */
+static inline int
+rndr_spend(struct sd_markdown *rndr, size_t steps)
+{
+	if (!rndr->budget)
+		return 1;
+
+	rndr->spent += steps;
+	return rndr->spent <= rndr->budget;
+}
+
+/* rndr_spent • tells if the work budget ran out */
+static inline int
+rndr_spent(struct sd_markdown *rndr)
+{
+	return rndr->budget && rndr->spent > rndr->budget;
+}
+
+/* rndr_reach • notes a search of the text that went past the block being
+ * parsed, up to `end`; searches of work buffers are within the block */
+static inline void
+rndr_reach(struct sd_markdown *rndr, const uint8_t *end)
+{
+	if ((uintptr_t)end >= (uintptr_t)rndr->range_text &&
+		(uintptr_t)end <= (uintptr_t)rndr->range_text_end &&
+		(uintptr_t)end > (uintptr_t)rndr->range_reach)
+		rndr->range_reach = end;
+}
+
+/* rndr_link • renders a link, or only its content for a header text */
+static int
+rndr_link(struct buf *ob, struct sd_markdown *rndr, const struct buf *link,
+	const struct buf *title, const struct buf *content, const struct buf *attr)
+{
+	rndr->links++;
+
+	if (rndr->links_as_text) {
+		if (content)
+			bufput(ob, content->data, content->size);
+		return 1;
+	}
+
+	return rndr->cb.link(ob, link, title, content, attr, rndr->opaque);
+}
+
+/* rndr_autolink • renders an autolink, or only its text for a header text */
+static int
+rndr_autolink(struct buf *ob, struct sd_markdown *rndr, const struct buf *link, enum mkd_autolink type)
+{
+	rndr->links++;
+
+	if (rndr->links_as_text) {
+		struct buf *text = rndr_newbuf(rndr, BUFFER_ATTRIBUTE);
+		size_t skip = bufprefix(link, "mailto:") == 0 ? 7 : 0;
+
+		bufput(text, link->data + skip, link->size - skip);
+		if (rndr->cb.normal_text)
+			rndr->cb.normal_text(ob, text, rndr->opaque);
+		else
+			bufput(ob, text->data, text->size);
+		rndr_popbuf(rndr, BUFFER_ATTRIBUTE);
+		return 1;
+	}
+
+	return rndr->cb.autolink(ob, link, type, rndr->opaque);
+}
+
 static void
 unscape_text(struct buf *ob, struct buf *src)
 {
@@ -180,58 +333,141 @@ hash_link_ref(const uint8_t *link_ref, size_t length)
 	return hash;
 }
 
-static struct link_ref *
+/* add_link_ref • records a reference; the name is stored lower case */
+static int
 add_link_ref(
-	struct link_ref **references,
-	const uint8_t *name, size_t name_size)
+	struct link_refs *refs,
+	const uint8_t *name, size_t name_size,
+	const uint8_t *link, size_t link_size,
+	const uint8_t *title, size_t title_size)
 {
-	struct link_ref *ref = calloc(1, sizeof(struct link_ref));
+	struct link_ref *ref;
+	size_t i, org;
 
-	if (!ref)
-		return NULL;
+	if (!refs->data) {
+		refs->data = bufnew_alloc(256, refs->allocator);
+		if (!refs->data)
+			return 0;
+		bufsetgrowth(refs->data, BUF_GROW_GEOMETRIC);
+	}
+
+	if (refs->size == refs->asize) {
+		size_t asize = refs->asize ? refs->asize * 2 : 16;
+		struct link_ref *item = bufrealloc(refs->allocator, refs->item,
+			refs->asize * sizeof(struct link_ref), asize * sizeof(struct link_ref));
+
+		if (!item)
+			return 0;
+
+		refs->item = item;
+		refs->asize = asize;
+	}
+
+	/* buffers are pointed at the data once it stops moving */
+	org = refs->data->size;
+	for (i = 0; i < name_size; ++i)
+		bufputc(refs->data, tolower(name[i]));
+	bufput(refs->data, link, link_size);
+	bufput(refs->data, title, title_size);
+
+	if (refs->data->error) {
+		refs->data->size = org;
+		refs->data->error = BUF_OK;
+		return 0;
+	}
 
+	ref = &refs->item[refs->size++];
+	memset(ref, 0x0, sizeof(struct link_ref));
 	ref->id = hash_link_ref(name, name_size);
-	ref->next = references[ref->id % REF_TABLE_SIZE];
+	ref->name.size = name_size;
+	ref->link.size = link_size;
+	ref->title.size = title_size;
+	ref->name.asize = org;	/* offset until index_link_refs */
 
-	references[ref->id % REF_TABLE_SIZE] = ref;
-	return ref;
+	return 1;
 }
 
-static struct link_ref *
-find_link_ref(struct link_ref **references, uint8_t *name, size_t length)
+/* index_link_refs • points the references at their data and builds the
+ * index, twice as large as the number of references */
+static int
+index_link_refs(struct link_refs *refs)
 {
-	unsigned int hash = hash_link_ref(name, length);
-	struct link_ref *ref = NULL;
+	size_t slots = 16, i, n;
 
-	ref = references[hash % REF_TABLE_SIZE];
+	if (!refs->size)
+		return 1;
 
-	while (ref != NULL) {
-		if (ref->id == hash)
-			return ref;
+	while (slots < refs->size * 2)
+		slots <<= 1;
+
+	refs->slots = bufrealloc(refs->allocator, NULL, 0, slots * sizeof(size_t));
+	if (!refs->slots)
+		return 0;
+
+	memset(refs->slots, 0x0, slots * sizeof(size_t));
+
+	refs->mask = slots - 1;
+
+	for (n = 0; n < refs->size; ++n) {
+		struct link_ref *ref = &refs->item[n];
+
+		ref->name.data = refs->data->data + ref->name.asize;
+		ref->link.data = ref->name.data + ref->name.size;
+		ref->title.data = ref->link.data + ref->link.size;
+		ref->name.asize = 0;
+
+		/* a name defined again takes the slot of the first one */
+		for (i = ref->id & refs->mask; refs->slots[i]; i = (i + 1) & refs->mask) {
+			struct link_ref *other = &refs->item[refs->slots[i] - 1];
 
-		ref = ref->next;
+			if (other->id == ref->id && other->name.size == ref->name.size &&
+				memcmp(other->name.data, ref->name.data, ref->name.size) == 0)
+				break;
+		}
+
+		refs->slots[i] = n + 1;
 	}
 
-	return NULL;
+	return 1;
 }
 
-static void
-free_link_refs(struct link_ref **references)
+static const struct link_ref *
+find_link_ref(const struct link_refs *refs, uint8_t *name, size_t length)
 {
-	size_t i;
+	unsigned int hash;
+	size_t i, j;
+
+	if (!refs || !refs->slots)
+		return NULL;
 
-	for (i = 0; i < REF_TABLE_SIZE; ++i) {
-		struct link_ref *r = references[i];
-		struct link_ref *next;
+	hash = hash_link_ref(name, length);
 
-		while (r) {
-			next = r->next;
-			bufrelease(r->link);
-			bufrelease(r->title);
-			free(r);
-			r = next;
-		}
+	for (i = hash & refs->mask; refs->slots[i]; i = (i + 1) & refs->mask) {
+		const struct link_ref *ref = &refs->item[refs->slots[i] - 1];
+
+		if (ref->id != hash || ref->name.size != length)
+			continue;
+
+		for (j = 0; j < length && tolower(name[j]) == ref->name.data[j]; ++j)
+			;
+
+		if (j == length)
+			return ref;
 	}
+
+	return NULL;
+}
+
+static void
+free_link_refs(struct link_refs *refs)
+{
+	const struct buf_allocator *allocator = refs->allocator;
+
+	buffree(allocator, refs->item);
+	buffree(allocator, refs->slots);
+	bufrelease(refs->data);
+	memset(refs, 0x0, sizeof(struct link_refs));
+	refs->allocator = allocator;
 }
 
 /*
@@ -357,15 +593,25 @@ parse_inline(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t siz
 	uint8_t action = 0;
 	struct buf work = { 0, 0, 0, 0 };
 
+	struct emph_memo outer = rndr->emph;
+
 	if (rndr->work_bufs[BUFFER_SPAN].size +
 		rndr->work_bufs[BUFFER_BLOCK].size > rndr->max_nesting)
 		return;
 
+	rndr->emph.end = data + size;
+	rndr->emph.size = size;
+	rndr->emph.failed = NULL;
+	rndr->emph.found = 0;
+
 	while (i < size) {
 		/* copying inactive chars into the output */
-		while (end < size && (action = rndr->active_char[data[end]]) == 0) {
-			end++;
-		}
+		if (end < size)
+			end += sd_scan_find(&rndr->active_scan, data + end, size - end);
+		action = end < size ? rndr->active_char[data[end]] : 0;
+
+		if (!rndr_spend(rndr, end - i + 1))
+			break;
 
 		if (rndr->cb.normal_text) {
 			work.data = data + i;
@@ -386,6 +632,9 @@ parse_inline(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t siz
 			end = i;
 		}
 	}
+
+	rndr_free(rndr, rndr->emph.failed);
+	rndr->emph = outer;
 }
 
 static void parse_attributes(struct buf *text, struct buf *attr, int is_header)
@@ -417,9 +666,98 @@ static void parse_attributes(struct buf *text, struct buf *attr, int is_header)
     }
 }
 
+/* EMPH_BIT • memo bit of an emphasis search of kind 1-3 for delimiter c */
+#define EMPH_BIT(kind, c) \
+	(1 << (((kind) - 1) * 3 + ((c) == '*' ? 0 : (c) == '_' ? 1 : 2)))
+
+/* emph_failed • tells if the chain through p is known to find no closing */
+static int
+emph_failed(struct sd_markdown *rndr, const uint8_t *p, int bit)
+{
+	struct emph_memo *memo = &rndr->emph;
+
+	return memo->failed && (memo->failed[memo->end - p] & bit);
+}
+
+/* emph_visit • records a candidate of the current search */
+static void
+emph_visit(struct sd_markdown *rndr, const uint8_t *p)
+{
+	if (rndr->emph_trail_size == rndr->emph_trail_asize) {
+		size_t asize = rndr->emph_trail_asize ? rndr->emph_trail_asize * 2 : 64;
+		size_t *trail = bufrealloc(rndr->allocator, rndr->emph_trail,
+			rndr->emph_trail_asize * sizeof(size_t), asize * sizeof(size_t));
+
+		/* without room the search is simply not remembered */
+		if (!trail)
+			return;
+
+		rndr->emph_trail = trail;
+		rndr->emph_trail_asize = asize;
+	}
+
+	rndr->emph_trail[rndr->emph_trail_size++] = rndr->emph.end - p;
+}
+
+/* emph_fail • remembers every candidate of a search that found nothing */
+static void
+emph_fail(struct sd_markdown *rndr, int bit)
+{
+	struct emph_memo *memo = &rndr->emph;
+	size_t i;
+
+	if (!memo->failed && rndr->emph_trail_size)
+		memo->failed = rndr_calloc(rndr, memo->size + 1, sizeof(uint16_t));
+
+	if (memo->failed)
+		for (i = 0; i < rndr->emph_trail_size; ++i)
+			memo->failed[rndr->emph_trail[i]] |= bit;
+
+	rndr->emph_trail_size = 0;
+}
+
+/* emph_closes • tells if the run has a closing ch at or after p */
+static int
+emph_closes(struct emph_memo *memo, const uint8_t *p, uint8_t ch)
+{
+	int n = (ch == '`') ? 0 : (ch == ']') ? 1 : 2;
+
+	if (!memo)
+		return 1;
+
+	if (!(memo->found & (1 << n))) {
+		const uint8_t *q = memo->end;
+
+		memo->last[n] = NULL;
+		while (q > memo->end - memo->size) {
+			if (*--q == ch) {
+				memo->last[n] = q;
+				break;
+			}
+		}
+		memo->found |= 1 << n;
+	}
+
+	return memo->last[n] && memo->last[n] >= p;
+}
+
+/* find_emph_first • first c from i, when nothing can close the construct
+ * the scan is in */
+static size_t
+find_emph_first(uint8_t *data, size_t i, size_t size, uint8_t c, size_t tmp_i)
+{
+	if (tmp_i)
+		return tmp_i;
+
+	while (i < size && data[i] != c)
+		i++;
+
+	return i < size ? i : 0;
+}
+
 /* find_emph_char • looks for the next emph uint8_t, skipping other constructs */
 static size_t
-find_emph_char(uint8_t *data, size_t size, uint8_t c)
+find_emph_char(uint8_t *data, size_t size, uint8_t c, struct emph_memo *memo)
 {
 	size_t i = 1;
 
@@ -449,6 +787,10 @@ find_emph_char(uint8_t *data, size_t size, uint8_t c)
 
 			if (i >= size) return 0;
 
+			/* no backtick left: the span runs to the end */
+			if (!emph_closes(memo, data + i, '`'))
+				return find_emph_first(data, i, size, c, 0);
+
 			/* finding the matching closing sequence */
 			bt = 0;
 			while (i < size && bt < span_nb) {
@@ -466,6 +808,9 @@ find_emph_char(uint8_t *data, size_t size, uint8_t c)
 			uint8_t cc;
 
 			i++;
+			if (!emph_closes(memo, data + i, ']'))
+				return find_emph_first(data, i, size, c, 0);
+
 			while (i < size && data[i] != ']') {
 				if (!tmp_i && data[i] == c) tmp_i = i;
 				i++;
@@ -493,6 +838,9 @@ find_emph_char(uint8_t *data, size_t size, uint8_t c)
 			}
 
 			i++;
+			if (!emph_closes(memo, data + i, cc))
+				return find_emph_first(data, i, size, c, tmp_i);
+
 			while (i < size && data[i] != cc) {
 				if (!tmp_i && data[i] == c) tmp_i = i;
 				i++;
@@ -522,12 +870,21 @@ parse_emph1(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t size
 	/* skipping one symbol if coming from emph3 */
 	if (size > 1 && data[0] == c && data[1] == c) i = 1;
 
+	rndr->emph_trail_size = 0;
+
 	while (i < size) {
-		len = find_emph_char(data + i, size - i, c);
-		if (!len) return 0;
+		len = find_emph_char(data + i, size - i, c, &rndr->emph);
+		if (!rndr_spend(rndr, len))
+			return 0;
+		if (!len || emph_failed(rndr, data + i + len, EMPH_BIT(1, c))) {
+			emph_fail(rndr, EMPH_BIT(1, c));
+			return 0;
+		}
 		i += len;
 		if (i >= size) return 0;
 
+		emph_visit(rndr, data + i);
+
 		if (data[i] == c && !_isspace(data[i - 1])) {
 
 			if (rndr->ext_flags & MKDEXT_NO_INTRA_EMPHASIS) {
@@ -535,6 +892,7 @@ parse_emph1(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t size
 					continue;
 			}
 
+			rndr->emph_trail_size = 0;
 			work = rndr_newbuf(rndr, BUFFER_SPAN);
 			parse_inline(work, rndr, data, i);
 			r = rndr->cb.emphasis(ob, work, rndr->opaque);
@@ -560,12 +918,22 @@ parse_emph2(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t size
 	if (!render_method)
 		return 0;
 
+	rndr->emph_trail_size = 0;
+
 	while (i < size) {
-		len = find_emph_char(data + i, size - i, c);
-		if (!len) return 0;
+		len = find_emph_char(data + i, size - i, c, &rndr->emph);
+		if (!rndr_spend(rndr, len))
+			return 0;
+		if (!len || emph_failed(rndr, data + i + len, EMPH_BIT(2, c))) {
+			emph_fail(rndr, EMPH_BIT(2, c));
+			return 0;
+		}
 		i += len;
 
+		emph_visit(rndr, data + i);
+
 		if (i + 1 < size && data[i] == c && data[i + 1] == c && i && !_isspace(data[i - 1])) {
+			rndr->emph_trail_size = 0;
 			work = rndr_newbuf(rndr, BUFFER_SPAN);
 			parse_inline(work, rndr, data, i);
 			r = render_method(ob, work, rndr->opaque);
@@ -585,15 +953,26 @@ parse_emph3(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t size
 	size_t i = 0, len;
 	int r;
 
+	rndr->emph_trail_size = 0;
+
 	while (i < size) {
-		len = find_emph_char(data + i, size - i, c);
-		if (!len) return 0;
+		len = find_emph_char(data + i, size - i, c, &rndr->emph);
+		if (!rndr_spend(rndr, len))
+			return 0;
+		if (!len || emph_failed(rndr, data + i + len, EMPH_BIT(3, c))) {
+			emph_fail(rndr, EMPH_BIT(3, c));
+			return 0;
+		}
 		i += len;
 
+		emph_visit(rndr, data + i);
+
 		/* skip whitespace preceded symbols */
 		if (data[i] != c || _isspace(data[i - 1]))
 			continue;
 
+		rndr->emph_trail_size = 0;
+
 		if (i + 2 < size && data[i + 1] == c && data[i + 2] == c && rndr->cb.triple_emphasis) {
 			/* triple symbol found */
 			struct buf *work = rndr_newbuf(rndr, BUFFER_SPAN);
@@ -769,6 +1148,19 @@ char_entity(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t offs
 	return end;
 }
 
+/* is_anchor_tag • tells if a tag opens or closes a raw html link */
+static int
+is_anchor_tag(const uint8_t *data, size_t size)
+{
+	size_t i = 1;
+
+	if (i < size && data[i] == '/')
+		i++;
+
+	return i + 1 < size && (data[i] == 'a' || data[i] == 'A') &&
+		(_isspace(data[i + 1]) || data[i + 1] == '>');
+}
+
 /* char_langle_tag • '<' when tags or autolinks are allowed */
 static size_t
 char_langle_tag(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t offset, size_t size)
@@ -784,11 +1176,20 @@ char_langle_tag(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t
 			work.data = data + 1;
 			work.size = end - 2;
 			unscape_text(u_link, &work);
-			ret = rndr->cb.autolink(ob, u_link, altype, rndr->opaque);
+			ret = rndr_autolink(ob, rndr, u_link, altype);
 			rndr_popbuf(rndr, BUFFER_SPAN);
 		}
-		else if (rndr->cb.raw_html_tag)
-			ret = rndr->cb.raw_html_tag(ob, &work, rndr->opaque);
+		else {
+			/* a raw html link is a link too: a header text keeps only
+			 * its content */
+			if (is_anchor_tag(data, end)) {
+				rndr->links++;
+				if (rndr->links_as_text)
+					return end;
+			}
+			if (rndr->cb.raw_html_tag)
+				ret = rndr->cb.raw_html_tag(ob, &work, rndr->opaque);
+		}
 	}
 
 	if (!ret) return 0;
@@ -815,10 +1216,10 @@ char_autolink_www(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_
 		if (rndr->cb.normal_text) {
 			link_text = rndr_newbuf(rndr, BUFFER_SPAN);
 			rndr->cb.normal_text(link_text, link, rndr->opaque);
-			rndr->cb.link(ob, link_url, NULL, link_text, NULL, rndr->opaque);
+			rndr_link(ob, rndr, link_url, NULL, link_text, NULL);
 			rndr_popbuf(rndr, BUFFER_SPAN);
 		} else {
-			rndr->cb.link(ob, link_url, NULL, link, NULL, rndr->opaque);
+			rndr_link(ob, rndr, link_url, NULL, link, NULL);
 		}
 		rndr_popbuf(rndr, BUFFER_SPAN);
 	}
@@ -840,7 +1241,7 @@ char_autolink_email(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, siz
 
 	if ((link_len = sd_autolink__email(&rewind, link, data, offset, size, 0)) > 0) {
 		ob->size -= rewind;
-		rndr->cb.autolink(ob, link, MKDA_EMAIL, rndr->opaque);
+		rndr_autolink(ob, rndr, link, MKDA_EMAIL);
 	}
 
 	rndr_popbuf(rndr, BUFFER_SPAN);
@@ -860,7 +1261,7 @@ char_autolink_url(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_
 
 	if ((link_len = sd_autolink__url(&rewind, link, data, offset, size, 0)) > 0) {
 		ob->size -= rewind;
-		rndr->cb.autolink(ob, link, MKDA_NORMAL, rndr->opaque);
+		rndr_autolink(ob, rndr, link, MKDA_NORMAL);
 	}
 
 	rndr_popbuf(rndr, BUFFER_SPAN);
@@ -905,7 +1306,7 @@ char_link(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t offset
 		}
 	}
 
-	if (i >= size)
+	if (!rndr_spend(rndr, i) || i >= size)
 		goto cleanup;
 
 	txt_e = i;
@@ -990,7 +1391,7 @@ char_link(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t offset
 	/* reference style link */
 	else if (i < size && data[i] == '[') {
 		struct buf id = { 0, 0, 0, 0 };
-		struct link_ref *lr;
+		const struct link_ref *lr;
 
 		/* looking for the id */
 		i++;
@@ -1028,15 +1429,15 @@ char_link(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t offset
 			goto cleanup;
 
 		/* keeping link and title from link_ref */
-		link = lr->link;
-		title = lr->title;
+		link = (struct buf *)&lr->link;
+		title = lr->title.size ? (struct buf *)&lr->title : NULL;
 		i++;
 	}
 
 	/* shortcut reference style link */
 	else {
 		struct buf id = { 0, 0, 0, 0 };
-		struct link_ref *lr;
+		const struct link_ref *lr;
 
 		/* crafting the id */
 		if (text_has_nl) {
@@ -1063,8 +1464,8 @@ char_link(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t offset
 			goto cleanup;
 
 		/* keeping link and title from link_ref */
-		link = lr->link;
-		title = lr->title;
+		link = (struct buf *)&lr->link;
+		title = lr->title.size ? (struct buf *)&lr->title : NULL;
 
 		/* rewinding the whitespace */
 		i = txt_e + 1;
@@ -1134,7 +1535,7 @@ char_link(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t offset
 
 		ret = rndr->cb.image(ob, u_link, title, content, attr, rndr->opaque);
 	} else {
-		ret = rndr->cb.link(ob, u_link, title, content, attr, rndr->opaque);
+		ret = rndr_link(ob, rndr, u_link, title, content, attr);
 	}
 
 	/* cleanup */
@@ -1459,7 +1860,7 @@ parse_blockquote(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t
 {
 	size_t beg, end = 0, pre, work_size = 0;
 	uint8_t *work_data = 0;
-	struct buf *out = 0;
+	struct buf *out = 0, *work = 0;
 
 	out = rndr_newbuf(rndr, BUFFER_BLOCK);
 	beg = 0;
@@ -1477,20 +1878,32 @@ parse_blockquote(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t
 				!is_empty(data + end, size - end))))
 			break;
 
-		if (beg < end) { /* copy into the in-place working buffer */
-			/* bufput(work, data + beg, end - beg); */
+		if (beg < end) {
+			/* contiguous lines are parsed in place; once a prefix is
+			 * skipped they are copied, the document is not modified.
+			 * The copy is not a nesting level: it is taken from the
+			 * attribute pool, which max_nesting does not count */
 			if (!work_data)
 				work_data = data + beg;
-			else if (data + beg != work_data + work_size)
-				memmove(work_data + work_size, data + beg, end - beg);
+			else if (!work && data + beg != work_data + work_size) {
+				work = rndr_newbuf(rndr, BUFFER_ATTRIBUTE);
+				bufput(work, work_data, work_size);
+			}
+			if (work)
+				bufput(work, data + beg, end - beg);
 			work_size += end - beg;
 		}
 		beg = end;
 	}
 
-	parse_block(out, rndr, work_data, work_size);
+	if (work)
+		parse_block(out, rndr, work->data, work->size);
+	else
+		parse_block(out, rndr, work_data, work_size);
 	if (rndr->cb.blockquote)
 		rndr->cb.blockquote(ob, out, rndr->opaque);
+	if (work)
+		rndr_popbuf(rndr, BUFFER_ATTRIBUTE);
 	rndr_popbuf(rndr, BUFFER_BLOCK);
 	return end;
 }
@@ -1498,6 +1911,36 @@ parse_blockquote(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t
 static size_t
 parse_htmlblock(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t size, int do_render);
 
+/* header_text • calls header_text with the content of a header: the
+ * rendered one when it has no link, otherwise it is parsed again with the
+ * links as their text. Its buffers are not nesting levels, they come from
+ * the attribute pool */
+static void
+header_text(struct sd_markdown *rndr, struct buf *content, size_t links,
+	uint8_t *data, size_t size, const struct buf *attr, int level)
+{
+	struct buf *text, *skip;
+
+	if (rndr->links == links) {
+		rndr->header_text(content, attr, level, rndr->header_text_opaque);
+		return;
+	}
+
+	text = rndr_newbuf(rndr, BUFFER_ATTRIBUTE);
+	skip = rndr_newbuf(rndr, BUFFER_ATTRIBUTE);
+
+	rndr->links_as_text = 1;
+	parse_inline(text, rndr, data, size);
+	rndr->links_as_text = 0;
+
+	if (rndr->ext_flags & MKDEXT_SPECIAL_ATTRIBUTES)
+		parse_attributes(text, skip, 1);
+	rndr->header_text(text, attr, level, rndr->header_text_opaque);
+
+	rndr_popbuf(rndr, BUFFER_ATTRIBUTE);
+	rndr_popbuf(rndr, BUFFER_ATTRIBUTE);
+}
+
 /* parse_blockquote • handles parsing of a regular paragraph */
 static size_t
 parse_paragraph(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t size)
@@ -1569,6 +2012,7 @@ parse_paragraph(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t
 	} else {
 		struct buf *header_work;
         struct buf *attr_work;
+		size_t links;
 
 		if (work.size) {
 			size_t beg;
@@ -1598,6 +2042,7 @@ parse_paragraph(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t
 
 		header_work = rndr_newbuf(rndr, BUFFER_SPAN);
         attr_work = rndr_newbuf(rndr, BUFFER_ATTRIBUTE);
+		links = rndr->links;
 		parse_inline(header_work, rndr, work.data, work.size);
 
 		if (rndr->cb.header) {
@@ -1605,6 +2050,9 @@ parse_paragraph(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t
                 parse_attributes(header_work, attr_work, 1);
             }
             rndr->cb.header(ob, header_work, attr_work, (int)level, rndr->opaque);
+            if (rndr->header_text)
+                header_text(rndr, header_work, links, work.data, work.size,
+                    attr_work, (int)level);
         }
 		rndr_popbuf(rndr, BUFFER_SPAN);
         rndr_popbuf(rndr, BUFFER_ATTRIBUTE);
@@ -1906,6 +2354,7 @@ parse_atxheader(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t
 	if (end > i) {
 		struct buf *work = rndr_newbuf(rndr, BUFFER_SPAN);
         struct buf *attr =  rndr_newbuf(rndr, BUFFER_ATTRIBUTE);
+		size_t links = rndr->links;
 
 		parse_inline(work, rndr, data + i, end - i);
 
@@ -1914,6 +2363,9 @@ parse_atxheader(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t
                 parse_attributes(work, attr, 1);
             }
             rndr->cb.header(ob, work, attr, (int)level, rndr->opaque);
+            if (rndr->header_text)
+                header_text(rndr, work, links, data + i, end - i, attr,
+                    (int)level);
         }
 
 		rndr_popbuf(rndr, BUFFER_SPAN);
@@ -1994,6 +2446,8 @@ htmlblock_end(const char *curtag,
 			return i + end_tag - 1;
 	}
 
+	/* a closing tag further on would have been found */
+	rndr_reach(rndr, data + size);
 	return 0;
 }
 
@@ -2038,6 +2492,8 @@ parse_htmlblock(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t
 					rndr->cb.blockhtml(ob, &work, rndr->opaque);
 				return work.size;
 			}
+
+			rndr_reach(rndr, data + size);
 		}
 
 		/* HR, which is the only self-closing block tag considered */
@@ -2056,6 +2512,8 @@ parse_htmlblock(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t
 					return work.size;
 				}
 			}
+
+			rndr_reach(rndr, data + size);
 		}
 
 		/* no special case recognised */
@@ -2189,7 +2647,7 @@ parse_table_header(
     }
 
 	*columns = pipes + 1;
-	*column_data = calloc(*columns, sizeof(int));
+	*column_data = rndr_calloc(rndr, *columns, sizeof(int));
 
 	/* Parse the header underline */
 	i++;
@@ -2300,7 +2758,7 @@ parse_table(
 			rndr->cb.table(ob, header_work, attr_work, body_work, rndr->opaque);
 	}
 
-	free(col_data);
+	rndr_free(rndr, col_data);
 	rndr_popbuf(rndr, BUFFER_SPAN);
 	rndr_popbuf(rndr, BUFFER_BLOCK);
     rndr_popbuf(rndr, BUFFER_ATTRIBUTE);
@@ -2319,7 +2777,14 @@ parse_block(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t size
 		rndr->work_bufs[BUFFER_BLOCK].size > rndr->max_nesting)
 		return;
 
-	while (beg < size) {
+	if (!rndr_spend(rndr, ob == rndr->range_ob && rndr->range_end < size ?
+		rndr->range_end : size))
+		return;
+
+	while (beg < size && !rndr_spent(rndr)) {
+		if (ob == rndr->range_ob && beg >= rndr->range_end)
+			break;
+
 		txt_data = data + beg;
 		end = size - beg;
 
@@ -2365,6 +2830,21 @@ parse_block(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t size
 
 		else
 			beg += parse_paragraph(ob, rndr, txt_data, end);
+
+		/* handing completed top-level blocks over to the caller, the
+		 * last byte stays for the renderers that test ob->size */
+		if (ob == rndr->flush_ob && ob->size > rndr->flush_size) {
+			rndr->flush(ob->data, ob->size - 1, rndr->flush_opaque);
+			ob->data[0] = ob->data[ob->size - 1];
+			ob->size = 1;
+		}
+	}
+
+	/* a range pays for the text of the blocks it started, past its end */
+	if (ob == rndr->range_ob) {
+		if (beg > rndr->range_end)
+			rndr_spend(rndr, beg - rndr->range_end);
+		rndr->range_next = beg;
 	}
 }
 
@@ -2376,7 +2856,7 @@ parse_block(struct buf *ob, struct sd_markdown *rndr, uint8_t *data, size_t size
 
 /* is_ref • returns whether a line is a reference or not */
 static int
-is_ref(const uint8_t *data, size_t beg, size_t end, size_t *last, struct link_ref **refs)
+is_ref(const uint8_t *data, size_t beg, size_t end, size_t *last, struct link_refs *refs)
 {
 /*	int n; */
 	size_t i = 0;
@@ -2469,21 +2949,11 @@ is_ref(const uint8_t *data, size_t beg, size_t end, size_t *last, struct link_re
 	if (last)
 		*last = line_end;
 
-	if (refs) {
-		struct link_ref *ref;
-
-		ref = add_link_ref(refs, data + id_offset, id_end - id_offset);
-		if (!ref)
-			return 0;
-
-		ref->link = bufnew(link_end - link_offset);
-		bufput(ref->link, data + link_offset, link_end - link_offset);
-
-		if (title_end > title_offset) {
-			ref->title = bufnew(title_end - title_offset);
-			bufput(ref->title, data + title_offset, title_end - title_offset);
-		}
-	}
+	if (refs && !add_link_ref(refs, data + id_offset, id_end - id_offset,
+			data + link_offset, link_end - link_offset,
+			data + title_offset,
+			title_end > title_offset ? title_end - title_offset : 0))
+		return 0;
 
 	return 1;
 }
@@ -2523,20 +2993,33 @@ sd_markdown_new(
 	size_t max_nesting,
 	const struct sd_callbacks *callbacks,
 	void *opaque)
+{
+	return sd_markdown_new_alloc(extensions, max_nesting, callbacks, opaque, NULL);
+}
+
+struct sd_markdown *
+sd_markdown_new_alloc(
+	unsigned int extensions,
+	size_t max_nesting,
+	const struct sd_callbacks *callbacks,
+	void *opaque,
+	const struct buf_allocator *allocator)
 {
 	struct sd_markdown *md = NULL;
 
 	assert(max_nesting > 0 && callbacks);
 
-	md = malloc(sizeof(struct sd_markdown));
+	md = bufrealloc(allocator, NULL, 0, sizeof(struct sd_markdown));
 	if (!md)
 		return NULL;
 
 	memcpy(&md->cb, callbacks, sizeof(struct sd_callbacks));
+	md->refs = NULL;
+	md->allocator = allocator;
 
-	stack_init(&md->work_bufs[BUFFER_BLOCK], 4);
-	stack_init(&md->work_bufs[BUFFER_SPAN], 8);
-    stack_init(&md->work_bufs[BUFFER_ATTRIBUTE], 1);
+	stack_init_alloc(&md->work_bufs[BUFFER_BLOCK], 4, allocator);
+	stack_init_alloc(&md->work_bufs[BUFFER_SPAN], 8, allocator);
+    stack_init_alloc(&md->work_bufs[BUFFER_ATTRIBUTE], 1, allocator);
 
 	memset(md->active_char, 0x0, 256);
 
@@ -2569,34 +3052,133 @@ sd_markdown_new(
 	if (extensions & MKDEXT_SUPERSCRIPT)
 		md->active_char['^'] = MD_CHAR_SUPERSCRIPT;
 
+	sd_scan_init(&md->active_scan, md->active_char, 0);
+
 	/* Extension data */
 	md->ext_flags = extensions;
 	md->opaque = opaque;
 	md->max_nesting = max_nesting;
+	md->buffer_limit = 0;
+	md->render = NULL;
+	md->budget = 0;
+	md->spent = 0;
 	md->in_link_body = 0;
+	md->links = 0;
+	md->links_as_text = 0;
+	md->header_text = NULL;
+	md->header_text_opaque = NULL;
+
+	memset(&md->emph, 0x0, sizeof(md->emph));
+	md->emph_trail = NULL;
+	md->emph_trail_size = 0;
+	md->emph_trail_asize = 0;
+
+	md->flush = NULL;
+	md->flush_opaque = NULL;
+	md->flush_size = 0;
+	md->flush_ob = NULL;
+
+	md->range_ob = NULL;
+	md->range_end = 0;
+	md->range_next = 0;
+	md->range_text = NULL;
+	md->range_text_end = NULL;
+	md->range_reach = NULL;
 
 	return md;
 }
 
 void
-sd_markdown_render(struct buf *ob, const uint8_t *document, size_t doc_size, struct sd_markdown *md)
+sd_markdown_set_buffer_limit(struct sd_markdown *md, size_t limit)
+{
+	md->buffer_limit = limit;
+}
+
+void
+sd_markdown_set_work_budget(struct sd_markdown *md, size_t steps)
+{
+	md->budget = steps;
+	md->spent = 0;
+}
+
+size_t
+sd_markdown_work_spent(const struct sd_markdown *md)
+{
+	return md->spent;
+}
+
+int
+sd_markdown_spend_work(struct sd_markdown *md, size_t steps)
+{
+	return rndr_spend(md, steps);
+}
+
+void
+sd_markdown_set_render_allocator(struct sd_markdown *md, const struct buf_allocator *allocator)
+{
+	md->render = allocator;
+}
+
+void
+sd_markdown_set_arena(struct sd_markdown *md, struct sd_arena *arena)
+{
+	md->render = arena ? sd_arena_allocator(arena) : NULL;
+}
+
+void
+sd_markdown_set_flush(
+	struct sd_markdown *md,
+	size_t size,
+	void (*flush)(const uint8_t *data, size_t size, void *opaque),
+	void *opaque)
+{
+	md->flush = flush;
+	md->flush_opaque = opaque;
+	md->flush_size = size;
+}
+
+void
+sd_markdown_set_header_text(
+	struct sd_markdown *md,
+	void (*header_text)(const struct buf *text, const struct buf *attr, int level, void *opaque),
+	void *opaque)
+{
+	md->header_text = header_text;
+	md->header_text_opaque = opaque;
+}
+
+static struct sd_document *
+document_new(
+	const uint8_t *document, size_t doc_size, size_t limit,
+	const struct buf_allocator *allocator)
 {
-#define MARKDOWN_GROW(x) ((x) + ((x) >> 1))
 	static const char UTF8_BOM[] = {0xEF, 0xBB, 0xBF};
 
+	struct sd_document *doc;
 	struct buf *text;
 	size_t beg, end;
 
-	text = bufnew(64);
-	if (!text)
-		return;
+	doc = bufrealloc(allocator, NULL, 0, sizeof(struct sd_document));
+	if (!doc)
+		return NULL;
+
+	memset(doc, 0x0, sizeof(struct sd_document));
+	doc->allocator = allocator;
+	doc->refs.allocator = allocator;
+
+	text = bufnew_alloc(64, allocator);
+	if (!text) {
+		buffree(allocator, doc);
+		return NULL;
+	}
+
+	bufsetgrowth(text, BUF_GROW_GEOMETRIC);
+	bufsetlimit(text, limit);
+	doc->text = text;
 
 	/* Preallocate enough space for our buffer to avoid expanding while copying */
 	bufgrow(text, doc_size);
 
-	/* reset the references table */
-	memset(&md->refs, 0x0, REF_TABLE_SIZE * sizeof(void *));
-
 	/* first pass: looking for references, copying everything else */
 	beg = 0;
 
@@ -2606,7 +3188,7 @@ sd_markdown_render(struct buf *ob, const uint8_t *document, size_t doc_size, str
 		beg += 3;
 
 	while (beg < doc_size) /* iterating over lines */
-		if (is_ref(document, beg, doc_size, &end, md->refs))
+		if (is_ref(document, beg, doc_size, &end, &doc->refs))
 			beg = end;
 		else { /* skipping to the next line */
 			end = beg;
@@ -2627,30 +3209,393 @@ sd_markdown_render(struct buf *ob, const uint8_t *document, size_t doc_size, str
 			beg = end;
 		}
 
+	/* adding a final newline if not already present */
+	if (text->size && text->data[text->size - 1] != '\n' && text->data[text->size - 1] != '\r')
+		bufputc(text, '\n');
+
+	if (!index_link_refs(&doc->refs)) {
+		sd_document_free(doc);
+		return NULL;
+	}
+
+	return doc;
+}
+
+struct sd_document *
+sd_document_new(const uint8_t *document, size_t doc_size, size_t limit)
+{
+	return document_new(document, doc_size, limit, NULL);
+}
+
+struct sd_document *
+sd_document_new_alloc(
+	const uint8_t *document, size_t doc_size, size_t limit,
+	const struct buf_allocator *allocator)
+{
+	return document_new(document, doc_size, limit, allocator);
+}
+
+size_t
+sd_document_length(const struct sd_document *doc)
+{
+	return doc->text->size;
+}
+
+/* sd_document_split • block starts spread over the text: a line at the
+ * margin after a blank line, outside of fences, that does not look like
+ * it continues a list, a quote or an html block; headers before it are
+ * counted the same way */
+size_t
+sd_document_split(const struct sd_document *doc, size_t *offsets, size_t *headers, size_t count)
+{
+	uint8_t *data = doc->text->data;
+	size_t size = doc->text->size;
+	size_t beg = 0, end, found = 0, n = 0;
+	int blank = 1, fence = 0, is_fence;
+	void *ptr;
+
+	while (beg < size && found < count) {
+		uint8_t *line = data + beg;
+
+		end = beg;
+		while (end < size && (line[end - beg] == ' ' || line[end - beg] == '\t'))
+			end++;
+
+		/* blank lines and lines that cannot be a fence are told apart
+		 * from the first visible byte */
+		if (end == size || data[end] == '\n') {
+			blank = 1;
+			beg = end + 1;
+			continue;
+		}
+
+		if (end - beg < 4 && (data[end] == '`' || data[end] == '~'))
+			is_fence = is_codefence(line, size - beg, NULL) != 0;
+		else
+			is_fence = 0;
+
+		ptr = memchr(data + end, '\n', size - end);
+		end = ptr ? (size_t)((uint8_t *)ptr - data) + 1 : size;
+
+		if (is_fence)
+			fence = !fence;
+		else if (!fence) {
+			if (blank && beg >= size / (count + 1) * (found + 1) &&
+				line[0] != ' ' && line[0] != '\t' &&
+				line[0] != '>' && line[0] != '<' &&
+				!prefix_uli(line, end - beg) && !prefix_oli(line, end - beg)) {
+				offsets[found] = beg;
+				if (headers)
+					headers[found] = n;
+				found++;
+			}
+
+			if (line[0] == '#' ||
+				(!blank && (line[0] == '=' || line[0] == '-') &&
+				 is_headerline(line, end - beg)))
+				n++;
+		}
+
+		blank = 0;
+		beg = end;
+	}
+
+	return found;
+}
+
+/* hash_bytes • 64-bit multiply and rotate hash, four independent lanes
+ * of 8 bytes at a time */
+static uint64_t
+hash_bytes(uint64_t hash, const uint8_t *data, size_t size)
+{
+#define HASH_MUL 0x9e3779b97f4a7c15ULL
+#define HASH_MIX(h, v) \
+	((((((h) ^ (v)) * HASH_MUL) << 31) | ((((h) ^ (v)) * HASH_MUL) >> 33)) * \
+	 0xc2b2ae3d27d4eb4fULL)
+	uint64_t lane[4], word;
+	size_t i = 0, l;
+
+	if (size >= 32) {
+		for (l = 0; l < 4; ++l)
+			lane[l] = hash + l * HASH_MUL;
+
+		for (; i + 32 <= size; i += 32) {
+			for (l = 0; l < 4; ++l) {
+				memcpy(&word, data + i + l * 8, 8);
+				lane[l] = HASH_MIX(lane[l], word);
+			}
+		}
+
+		for (l = 0; l < 4; ++l)
+			hash = HASH_MIX(hash, lane[l]);
+	}
+
+	for (; i + 8 <= size; i += 8) {
+		memcpy(&word, data + i, 8);
+		hash = HASH_MIX(hash, word);
+	}
+
+	word = size;
+	for (; i < size; ++i)
+		word = (word << 8) | data[i];
+	hash = HASH_MIX(hash, word);
+
+	hash ^= hash >> 29;
+	hash *= 0xbf58476d1ce4e5b9ULL;
+	hash ^= hash >> 32;
+
+	return hash;
+#undef HASH_MIX
+#undef HASH_MUL
+}
+
+uint64_t
+sd_document_hash(const struct sd_document *doc, size_t begin, size_t end)
+{
+	if (end > doc->text->size)
+		end = doc->text->size;
+	if (begin > end)
+		begin = end;
+
+	return hash_bytes(0, doc->text->data + begin, end - begin);
+}
+
+uint64_t
+sd_document_refs_hash(const struct sd_document *doc)
+{
+	const struct link_refs *refs = &doc->refs;
+	uint64_t hash = refs->size;
+	size_t i;
+
+	for (i = 0; i < refs->size; ++i) {
+		const struct link_ref *ref = &refs->item[i];
+
+		hash = hash_bytes(hash, ref->name.data, ref->name.size);
+		hash = hash_bytes(hash, ref->link.data, ref->link.size);
+		hash = hash_bytes(hash, ref->title.data, ref->title.size);
+	}
+
+	return hash;
+}
+
+size_t
+sd_document_size(const struct sd_document *doc)
+{
+	size_t size = doc->text->asize;
+
+	if (doc->refs.data)
+		size += doc->refs.data->asize;
+
+	return size + doc->refs.asize * sizeof(struct link_ref) +
+		(doc->refs.slots ? (doc->refs.mask + 1) * sizeof(size_t) : 0);
+}
+
+void
+sd_document_free(struct sd_document *doc)
+{
+	if (!doc)
+		return;
+
+	bufrelease(doc->text);
+	free_link_refs(&doc->refs);
+	buffree(doc->allocator, doc);
+}
+
+/* render_range • renders the top-level blocks starting in [begin, end) */
+static int
+render_range(
+	struct buf *ob, const struct sd_document *doc, struct sd_markdown *md,
+	size_t begin, size_t end, size_t *next)
+{
+#define MARKDOWN_GROW(x) ((x) + ((x) >> 1))
+	const struct buf *text = doc->text;
+	size_t i;
+	int type, err, primed = 0;
+
+	if (end > text->size)
+		end = text->size;
+	if (begin > end)
+		begin = end;
+
+	/* the document is only read: references are looked up in place */
+	md->refs = &doc->refs;
+
 	/* pre-grow the output buffer to minimize allocations */
-	bufgrow(ob, MARKDOWN_GROW(text->size));
+	if (md->flush && md->flush_size < end - begin)
+		bufgrow(ob, MARKDOWN_GROW(md->flush_size));
+	else
+		bufgrow(ob, MARKDOWN_GROW(end - begin));
+
+	/* renderers test ob->size for the output of earlier blocks: a
+	 * byte stands for it and is taken out at the end */
+	if (begin && !ob->size) {
+		bufputc(ob, '\n');
+		primed = 1;
+	}
+
+	md->flush_ob = (md->flush && !primed) ? ob : NULL;
+	md->range_ob = ob;
+	md->range_end = end - begin;
+	md->range_next = text->size - begin;
+	md->range_text = text->data;
+	md->range_text_end = text->data + text->size;
+	md->range_reach = NULL;
 
 	/* second pass: actual rendering */
-	if (md->cb.doc_header)
+	if (!begin && md->cb.doc_header)
 		md->cb.doc_header(ob, md->opaque);
 
-	if (text->size) {
-		/* adding a final newline if not already present */
-		if (text->data[text->size - 1] != '\n' &&  text->data[text->size - 1] != '\r')
-			bufputc(text, '\n');
+	if (begin < text->size)
+		parse_block(ob, md, text->data + begin, text->size - begin);
 
-		parse_block(ob, md, text->data, text->size);
-	}
+	*next = begin + md->range_next;
 
-	if (md->cb.doc_footer)
+	if (*next >= text->size && md->cb.doc_footer)
 		md->cb.doc_footer(ob, md->opaque);
 
-	/* clean-up */
-	bufrelease(text);
-	free_link_refs(md->refs);
+	if (primed)
+		bufslurp(ob, 1);
+
+	md->flush_ob = NULL;
+	md->range_ob = NULL;
+	md->range_text = NULL;
+	md->range_text_end = NULL;
+	md->refs = NULL;
+
+	/* an aborted render comes first, then the first dropped write */
+	if (rndr_spent(md))
+		err = SD_EBUDGET;
+	else
+		err = ob->error ? ob->error : text->error;
+	for (type = 0; type < 3; ++type) {
+		struct stack *pool = &md->work_bufs[type];
+
+		for (i = 0; i < pool->asize; ++i) {
+			struct buf *work = pool->item[i];
+
+			if (!work)
+				break;
+			if (err == BUF_OK)
+				err = work->error;
+			work->error = BUF_OK;
+
+			/* buffers of the arena only live as long as the render;
+			 * they come after the pooled ones */
+			if (md->render && work->allocator == md->render)
+				pool->item[i] = NULL;
+		}
+	}
 
 	assert(md->work_bufs[BUFFER_SPAN].size == 0);
 	assert(md->work_bufs[BUFFER_BLOCK].size == 0);
+
+	return err;
+}
+
+int
+sd_markdown_render_document(struct buf *ob, const struct sd_document *doc, struct sd_markdown *md)
+{
+	size_t next;
+
+	md->spent = 0;
+
+	return render_range(ob, doc, md, 0, doc->text->size, &next);
+}
+
+int
+sd_markdown_render_range(
+	struct buf *ob, const struct sd_document *doc, struct sd_markdown *md,
+	size_t begin, size_t end, size_t *next)
+{
+	return render_range(ob, doc, md, begin, end, next);
+}
+
+int
+sd_markdown_render_block(
+	struct buf *ob, const struct sd_document *doc, struct sd_markdown *md,
+	size_t begin, size_t *next, size_t *reach)
+{
+	const struct buf *text = doc->text;
+	const uint8_t *eol;
+	size_t i, w;
+	int err;
+
+	/* empty lines render nothing: they go with the block after them */
+	for (i = begin; i < text->size &&
+		(w = is_empty(text->data + i, text->size - i)) != 0; i += w)
+		;
+
+	/* an empty output means the blocks before it have none either; they
+	 * are rendered again so that the block comes out as the first one */
+	err = render_range(ob, doc, md, ob->size ? begin : 0, i + 1, next);
+
+	/* the end of a block is found on the first line after it */
+	i = *next;
+	while (i < text->size && (w = is_empty(text->data + i, text->size - i)) != 0)
+		i += w;
+	if (i < text->size) {
+		eol = memchr(text->data + i, '\n', text->size - i);
+		i = eol ? (size_t)(eol - text->data) + 1 : text->size;
+	}
+	if (i > text->size)
+		i = text->size;
+
+	if (md->range_reach && (size_t)(md->range_reach - text->data) > i)
+		i = md->range_reach - text->data;
+	*reach = i;
+
+	return err;
+}
+
+int
+sd_markdown_render(struct buf *ob, const uint8_t *document, size_t doc_size, struct sd_markdown *md)
+{
+	struct sd_document *doc;
+	int err;
+
+	doc = document_new(document, doc_size, md->buffer_limit, rndr_allocator(md));
+	if (!doc)
+		return BUF_ENOMEM;
+
+	err = sd_markdown_render_document(ob, doc, md);
+
+	sd_document_free(doc);
+
+	return err;
+}
+
+void
+sd_markdown_reset(struct sd_markdown *md, size_t keep)
+{
+	size_t i;
+	int type;
+
+	md->buffer_limit = 0;
+	md->render = NULL;
+	md->budget = 0;
+	md->in_link_body = 0;
+	md->links_as_text = 0;
+	md->header_text = NULL;
+	md->header_text_opaque = NULL;
+
+	md->flush = NULL;
+	md->flush_opaque = NULL;
+	md->flush_size = 0;
+	md->flush_ob = NULL;
+
+	if (!keep)
+		return;
+
+	for (type = 0; type < 3; ++type) {
+		struct stack *pool = &md->work_bufs[type];
+
+		for (i = 0; i < pool->asize; ++i) {
+			struct buf *work = pool->item[i];
+
+			if (work && work->asize > keep)
+				bufreset(work);
+		}
+	}
 }
 
 void
@@ -2671,7 +3616,8 @@ sd_markdown_free(struct sd_markdown *md)
 	stack_free(&md->work_bufs[BUFFER_BLOCK]);
     stack_free(&md->work_bufs[BUFFER_ATTRIBUTE]);
 
-	free(md);
+	buffree(md->allocator, md->emph_trail);
+	buffree(md->allocator, md);
 }
 
 void
@@ -101,6 +101,17 @@ struct sd_callbacks {
 };
 
 struct sd_markdown;
+struct sd_arena;
+
+/* render errors, beside the buffer errors of buffer.h */
+enum sd_render_error {
+	SD_EBUDGET = -3,	/* the work budget ran out, rendering stopped */
+};
+
+/* sd_document: a document after the first pass (references collected,
+ * tabs expanded, newlines normalized); it is not modified by rendering
+ * and can be rendered any number of times, by any instance */
+struct sd_document;
 
 /*********
  * FLAGS *
@@ -122,9 +133,136 @@ sd_markdown_new(
 	const struct sd_callbacks *callbacks,
 	void *opaque);
 
+/* new_alloc: same as sd_markdown_new, the instance and its pooled work
+ * buffers taken from an allocator (NULL for malloc) */
+extern struct sd_markdown *
+sd_markdown_new_alloc(
+	unsigned int extensions,
+	size_t max_nesting,
+	const struct sd_callbacks *callbacks,
+	void *opaque,
+	const struct buf_allocator *allocator);
+
+extern void
+sd_markdown_set_buffer_limit(struct sd_markdown *md, size_t limit);
+
+/* work budget: rendering stops once about `steps` bytes have been
+ * scanned, counting the rescans of nested blocks and inline lookups
+ * (0 for no limit). The ranges rendered after it add up against it; a
+ * full render starts from nothing spent */
 extern void
+sd_markdown_set_work_budget(struct sd_markdown *md, size_t steps);
+
+/* work spent: steps counted against the work budget since it was set */
+extern size_t
+sd_markdown_work_spent(const struct sd_markdown *md);
+
+/* spend work: counts the steps of a range rendered by another instance
+ * against the work budget; returns 0 once it is spent */
+extern int
+sd_markdown_spend_work(struct sd_markdown *md, size_t steps);
+
+/* render allocator: the document and work buffers of the renders that
+ * follow come from the allocator, to be released by the caller once
+ * rendering is over (free may be NULL); buffers pooled by earlier renders
+ * are still reused (NULL for the instance allocator) */
+extern void
+sd_markdown_set_render_allocator(struct sd_markdown *md, const struct buf_allocator *allocator);
+
+/* arena: sd_markdown_set_render_allocator with an arena */
+extern void
+sd_markdown_set_arena(struct sd_markdown *md, struct sd_arena *arena);
+
+/* flush: called with the completed top-level blocks once the output holds
+ * more than `size` bytes; the last output byte is kept back in ob */
+extern void
+sd_markdown_set_flush(
+	struct sd_markdown *md,
+	size_t size,
+	void (*flush)(const uint8_t *data, size_t size, void *opaque),
+	void *opaque);
+
+/* header text: called after the header callback with the content of each
+ * header, its links rendered as their text only; NULL to stop */
+extern void
+sd_markdown_set_header_text(
+	struct sd_markdown *md,
+	void (*header_text)(const struct buf *text, const struct buf *attr, int level, void *opaque),
+	void *opaque);
+
+/* returns BUF_OK, SD_EBUDGET when the work budget ran out, or the first
+ * buffer error (BUF_ELIMIT, BUF_ENOMEM) when output had to be dropped */
+extern int
 sd_markdown_render(struct buf *ob, const uint8_t *document, size_t doc_size, struct sd_markdown *md);
 
+extern struct sd_document *
+sd_document_new(const uint8_t *document, size_t doc_size, size_t limit);
+
+extern struct sd_document *
+sd_document_new_alloc(
+	const uint8_t *document, size_t doc_size, size_t limit,
+	const struct buf_allocator *allocator);
+
+/* length: size of the text to render, after the first pass */
+extern size_t
+sd_document_length(const struct sd_document *doc);
+
+/* split: up to `count` offsets of the text, in order and evenly spread,
+ * where a top-level block is likely to start; headers[i] (when not NULL)
+ * gets an estimate of the headers before offsets[i]. Returns the number
+ * of offsets found */
+extern size_t
+sd_document_split(const struct sd_document *doc, size_t *offsets, size_t *headers, size_t count);
+
+/* hash: 64-bit hash of the text in [begin, end) */
+extern uint64_t
+sd_document_hash(const struct sd_document *doc, size_t begin, size_t end);
+
+/* refs_hash: 64-bit hash of the reference definitions, in order */
+extern uint64_t
+sd_document_refs_hash(const struct sd_document *doc);
+
+/* size: bytes held by the document, text and references */
+extern size_t
+sd_document_size(const struct sd_document *doc);
+
+extern void
+sd_document_free(struct sd_document *doc);
+
+/* same as sd_markdown_render, without the first pass; a buffer error met
+ * while building the document is returned here */
+extern int
+sd_markdown_render_document(struct buf *ob, const struct sd_document *doc, struct sd_markdown *md);
+
+/* render_range: renders the top-level blocks starting in [begin, end);
+ * *next gets the end of the last one, at or after `end` when a block runs
+ * over it, the text length once the document is done. The output of a
+ * range starting at a block start, appended to the output of the blocks
+ * before it when there is some, is the output of a full render;
+ * doc_header is only called for the range starting at 0, doc_footer for
+ * the last one. Instances rendering the same document can run in
+ * parallel */
+extern int
+sd_markdown_render_range(
+	struct buf *ob, const struct sd_document *doc, struct sd_markdown *md,
+	size_t begin, size_t end, size_t *next);
+
+/* render_block: renders the top-level block starting at `begin`, with
+ * the empty lines before it, after the output of the blocks before it,
+ * held by ob; *next gets its end and
+ * *reach the end of the text read to render it. With the same references,
+ * the same text in [begin, *reach) and output before it or not, the block
+ * renders the same in an edited document */
+extern int
+sd_markdown_render_block(
+	struct buf *ob, const struct sd_document *doc, struct sd_markdown *md,
+	size_t begin, size_t *next, size_t *reach);
+
+/* reset: prepares an instance for reuse, clearing the per-render settings
+ * and releasing pooled work buffers larger than `keep` bytes (0 keeps all) */
+extern void
+sd_markdown_reset(struct sd_markdown *md, size_t keep);
+
 extern void
 sd_markdown_free(struct sd_markdown *md);
 
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2011, Vicent Marti
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "scan.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define SCAN_X86 1
+#	include <immintrin.h>
+#endif
+
+static size_t
+scan_find_scalar(const struct sd_scan *scan, const uint8_t *data, size_t size)
+{
+	size_t i = 0;
+
+	while (i < size && scan->table[data[i]] == 0)
+		i++;
+
+	return i;
+}
+
+#ifdef SCAN_X86
+/* one compare per byte of the set, 16 bytes at a time; slower than the
+ * byte loop once the set has more than 8 bytes */
+__attribute__((target("sse2")))
+static size_t
+scan_find_sse2(const struct sd_scan *scan, const uint8_t *data, size_t size)
+{
+	__m128i set[8];
+	size_t i = 0, n;
+
+	for (n = 0; n < scan->nchars; ++n)
+		set[n] = _mm_set1_epi8((char)scan->chars[n]);
+
+	while (i + 16 <= size) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+		__m128i hit = _mm_cmpeq_epi8(v, set[0]);
+		int mask;
+
+		for (n = 1; n < scan->nchars; ++n)
+			hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, set[n]));
+
+		mask = _mm_movemask_epi8(hit);
+		if (mask)
+			return i + __builtin_ctz(mask);
+
+		i += 16;
+	}
+
+	return i + scan_find_scalar(scan, data + i, size - i);
+}
+
+/* nibble lookup: a byte is in the set when the row bit of its high nibble
+ * is set for its low nibble, 32 bytes at a time */
+__attribute__((target("avx2")))
+static size_t
+scan_find_avx2(const struct sd_scan *scan, const uint8_t *data, size_t size)
+{
+	const __m256i lo = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *)scan->lo));
+	const __m256i hi = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *)scan->hi));
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i = 0;
+
+	while (i + 32 <= size) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+		__m256i rows = _mm256_shuffle_epi8(lo, _mm256_and_si256(v, nibble));
+		__m256i bits = _mm256_shuffle_epi8(hi,
+			_mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+		unsigned int mask = ~(unsigned int)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(_mm256_and_si256(rows, bits), zero));
+
+		if (mask)
+			return i + __builtin_ctz(mask);
+
+		i += 32;
+	}
+
+	return i + scan_find_scalar(scan, data + i, size - i);
+}
+#endif
+
+/* sets the nibble tables; 0 when the set needs more than 8 distinct rows */
+static int
+scan_nibbles(struct sd_scan *scan)
+{
+	uint16_t rows[16], seen[8];
+	size_t h, l, k, nrows = 0;
+
+	for (h = 0; h < 16; ++h) {
+		rows[h] = 0;
+		for (l = 0; l < 16; ++l)
+			if (scan->table[(h << 4) | l])
+				rows[h] |= (uint16_t)(1 << l);
+	}
+
+	memset(scan->lo, 0, sizeof(scan->lo));
+	memset(scan->hi, 0, sizeof(scan->hi));
+
+	for (h = 0; h < 16; ++h) {
+		if (rows[h] == 0)
+			continue;
+
+		for (k = 0; k < nrows && seen[k] != rows[h]; ++k)
+			;
+
+		if (k == nrows) {
+			if (nrows == 8)
+				return 0;
+			seen[nrows++] = rows[h];
+			for (l = 0; l < 16; ++l)
+				if (rows[h] & (1 << l))
+					scan->lo[l] |= (uint8_t)(1 << k);
+		}
+
+		scan->hi[h] = (uint8_t)(1 << k);
+	}
+
+	return 1;
+}
+
+void
+sd_scan_init(struct sd_scan *scan, const uint8_t *table, int complement)
+{
+	size_t i;
+	int nibbles;
+
+	scan->nchars = 0;
+	for (i = 0; i < 256; ++i) {
+		scan->table[i] = (table[i] != 0) != (complement != 0);
+		if (scan->table[i] && scan->nchars < sizeof(scan->chars))
+			scan->chars[scan->nchars] = (uint8_t)i;
+		if (scan->table[i])
+			scan->nchars++;
+	}
+
+	nibbles = scan_nibbles(scan);
+	scan->find = scan_find_scalar;
+
+#ifdef SCAN_X86
+	if (nibbles && __builtin_cpu_supports("avx2"))
+		scan->find = scan_find_avx2;
+	else if (scan->nchars > 0 && scan->nchars <= sizeof(scan->chars) &&
+		 __builtin_cpu_supports("sse2"))
+		scan->find = scan_find_sse2;
+#else
+	(void)nibbles;
+#endif
+}
+
+void
+sd_scan_once(struct sd_scan *scan, const uint8_t *table, int complement)
+{
+	struct sd_scan local;
+
+#ifdef __GNUC__
+	if (__atomic_load_n(&scan->find, __ATOMIC_ACQUIRE))
+		return;
+
+	/* racing threads store the same bytes; find is published last */
+	sd_scan_init(&local, table, complement);
+	memcpy(scan->table, local.table, sizeof(local.table));
+	memcpy(scan->lo, local.lo, sizeof(local.lo));
+	memcpy(scan->hi, local.hi, sizeof(local.hi));
+	memcpy(scan->chars, local.chars, sizeof(local.chars));
+	scan->nchars = local.nchars;
+	__atomic_store_n(&scan->find, local.find, __ATOMIC_RELEASE);
+#else
+	if (scan->find)
+		return;
+
+	sd_scan_init(&local, table, complement);
+	*scan = local;
+#endif
+}
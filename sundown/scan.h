@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2011, Vicent Marti
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SCAN_H__
+#define SCAN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* sd_scan: finds the next byte of a set, several bytes at a time when the
+ * CPU allows it (AVX2 or SSE2, chosen at run time) */
+struct sd_scan {
+	size_t (*find)(const struct sd_scan *, const uint8_t *, size_t);
+	uint8_t table[256];	/* non-zero for the bytes of the set */
+	uint8_t lo[16];		/* AVX2: rows of the set by low nibble */
+	uint8_t hi[16];		/* AVX2: row bit of each high nibble */
+	uint8_t chars[8];	/* SSE2: bytes of the set, when few */
+	size_t nchars;
+};
+
+/* sd_scan_init: the set is every byte with a non-zero entry in table, or
+ * with a zero entry when complement is set */
+void sd_scan_init(struct sd_scan *, const uint8_t *table, int complement);
+
+/* sd_scan_once: sd_scan_init for a scanner shared between threads, built
+ * by the first call */
+void sd_scan_once(struct sd_scan *, const uint8_t *table, int complement);
+
+/* sd_scan_find: offset of the first byte of the set, or size */
+static inline size_t
+sd_scan_find(const struct sd_scan *scan, const uint8_t *data, size_t size)
+{
+	return scan->find(scan, data, size);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
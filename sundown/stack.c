@@ -9,7 +9,8 @@ stack_grow(struct stack *st, size_t new_size)
 	if (st->asize >= new_size)
 		return 0;
 
-	new_st = realloc(st->item, new_size * sizeof(void *));
+	new_st = bufrealloc(st->allocator, st->item,
+		st->asize * sizeof(void *), new_size * sizeof(void *));
 	if (new_st == NULL)
 		return -1;
 
@@ -31,7 +32,7 @@ stack_free(struct stack *st)
 	if (!st)
 		return;
 
-	free(st->item);
+	buffree(st->allocator, st->item);
 
 	st->item = NULL;
 	st->size = 0;
@@ -40,10 +41,18 @@ stack_free(struct stack *st)
 
 int
 stack_init(struct stack *st, size_t initial_size)
+{
+	return stack_init_alloc(st, initial_size, NULL);
+}
+
+int
+stack_init_alloc(struct stack *st, size_t initial_size,
+	const struct buf_allocator *allocator)
 {
 	st->item = NULL;
 	st->size = 0;
 	st->asize = 0;
+	st->allocator = allocator;
 
 	if (!initial_size)
 		initial_size = 8;
@@ -3,6 +3,8 @@
 
 #include <stdlib.h>
 
+#include "buffer.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -11,11 +13,13 @@ struct stack {
 	void **item;
 	size_t size;
 	size_t asize;
+	const struct buf_allocator *allocator;	/* NULL for malloc */
 };
 
 void stack_free(struct stack *);
 int stack_grow(struct stack *, size_t);
 int stack_init(struct stack *, size_t);
+int stack_init_alloc(struct stack *, size_t, const struct buf_allocator *);
 
 int stack_push(struct stack *, void *);
 